@@ -0,0 +1,168 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "SidDumpReader.h"
+
+// Columnar register dump: one separately encoded stream per SID register,
+// plus the frame period and the playroutine cycle count.
+//
+// Header:    "SDC1", u32 frame count, u32 column count
+// Directory: per column u8 column id, u8 encoding, u16 reserved,
+//            u32 file offset, u32 byte length
+// Columns:   0-24 = SID registers (RLE8), 25 = dt in us (RLE16),
+//            26 = cycles (DELTA)
+//
+// RLE8:  varint run length, value byte
+// RLE16: varint run length, u16 value
+// DELTA: zigzag varint difference to the previous value (starts at 0)
+//
+// Varints are 7 bits per byte, low bits first, bit 7 set on all but the
+// last byte. All fixed size numbers are little endian.
+
+enum ColumnEncoding
+{
+  COLUMN_RLE8 = 0,
+  COLUMN_RLE16 = 1,
+  COLUMN_DELTA = 2
+};
+
+#define COLUMN_DT 25
+#define COLUMN_CYCLES 26
+#define COLUMN_COUNT 27
+
+static inline void putVarint(std::vector<unsigned char> &dest, uint32_t v)
+{
+  while (v >= 0x80)
+  {
+    dest.push_back((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  dest.push_back(v);
+}
+
+static inline bool getVarint(const unsigned char *&p, const unsigned char *end, uint32_t &v)
+{
+  v = 0;
+  for (int shift = 0; p < end && shift < 35; shift += 7)
+  {
+    unsigned char b = *p++;
+    v |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+// Encodes one column, values are added a frame at a time
+class ColumnEncoder {
+  public:
+    ColumnEncoder(ColumnEncoding encoding = COLUMN_RLE8) : encoding(encoding) {}
+
+    void add(uint32_t value)
+    {
+      if (encoding == COLUMN_DELTA)
+      {
+        int32_t delta = (int32_t)(value - last);
+        putVarint(data, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+        last = value;
+        return;
+      }
+      if (run && value == last)
+      {
+        run++;
+        return;
+      }
+      flushRun();
+      last = value;
+      run = 1;
+    }
+
+    // finish the column, returns its encoded bytes
+    const std::vector<unsigned char> &finish()
+    {
+      flushRun();
+      return data;
+    }
+
+    ColumnEncoding encoding;
+
+  private:
+    void flushRun()
+    {
+      if (!run)
+        return;
+      putVarint(data, run);
+      data.push_back(last & 0xff);
+      if (encoding == COLUMN_RLE16)
+        data.push_back(last >> 8);
+      run = 0;
+    }
+
+    std::vector<unsigned char> data;
+    uint32_t last = 0;
+    uint32_t run = 0;
+};
+
+// Reads single columns of a columnar dump. The file is memory mapped, a
+// query only touches the pages of the columns it decodes.
+class ColumnReader {
+  public:
+    bool open(const char *filename)
+    {
+      if (!file.open(filename) || file.size < 12 || memcmp(file.data, "SDC1", 4))
+        return false;
+      framecount = get32(&file.data[4]);
+      columncount = get32(&file.data[8]);
+      return file.size >= 12 + (size_t)columncount * 12;
+    }
+
+    unsigned int frames() const { return framecount; }
+
+    // decode column id into values, one per frame
+    bool column(int id, std::vector<uint32_t> &values)
+    {
+      values.clear();
+      for (unsigned int c = 0; c < columncount; c++)
+      {
+        const unsigned char *entry = &file.data[12 + c * 12];
+        if (entry[0] != id)
+          continue;
+
+        size_t offset = get32(&entry[4]);
+        size_t length = get32(&entry[8]);
+        if (offset + length > file.size)
+          return false;
+        return decode((ColumnEncoding)entry[1], &file.data[offset], &file.data[offset + length], values);
+      }
+      return false;
+    }
+
+  private:
+    bool decode(ColumnEncoding encoding, const unsigned char *p, const unsigned char *end, std::vector<uint32_t> &values)
+    {
+      values.reserve(framecount);
+      uint32_t last = 0;
+      while (p < end)
+      {
+        uint32_t v;
+        if (!getVarint(p, end, v)) return false;
+        if (encoding == COLUMN_DELTA)
+        {
+          last += (v >> 1) ^ (0u - (v & 1));
+          values.push_back(last);
+          continue;
+        }
+
+        int width = (encoding == COLUMN_RLE16) ? 2 : 1;
+        if (end - p < width) return false;
+        uint32_t value = (width == 2) ? (p[0] | (p[1] << 8)) : p[0];
+        p += width;
+        values.insert(values.end(), v, value);
+      }
+      return values.size() == framecount;
+    }
+
+    MappedFile file;
+    unsigned int framecount = 0;
+    unsigned int columncount = 0;
+};
@@ -0,0 +1,266 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "SidDumpReader.h"
+#include "SidOutput.h"
+
+// Offset of the first byte that differs between a and b, n if none does.
+// Compares 32 (AVX2) or 16 (SSE2) bytes at a time.
+static inline size_t firstDifference(const unsigned char *a, const unsigned char *b, size_t n)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i *)&a[i]);
+    __m256i y = _mm256_loadu_si256((const __m256i *)&b[i]);
+    uint32_t equal = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    if (equal != 0xffffffff)
+      return i + __builtin_ctz(~equal);
+  }
+#elif defined(__SSE2__)
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+    __m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+    uint32_t equal = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if (equal != 0xffff)
+      return i + __builtin_ctz(~equal);
+  }
+#endif
+  for (; i < n; i++)
+    if (a[i] != b[i])
+      return i;
+  return n;
+}
+
+// Rolling checksum of the frames an output got: each frame's value covers
+// its registers and all frames before it, so two runs match up to the
+// first frame whose checksums differ, and the last checksum alone says
+// whether two whole runs are the same.
+static inline uint32_t frameChecksum(uint32_t previous, const unsigned char *packed)
+{
+  uint64_t h = previous ^ 0x9e3779b97f4a7c15ull;
+  for (int i = 0; i < 32; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, &packed[i], 8);
+    h = (h ^ word) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  return (uint32_t)h;
+}
+
+// Writes the checksum sidecar <songfilename>.sum next to whatever the
+// wrapped output does:
+//   "SDCK", u32 version (1), then per frame its u32 rolling checksum,
+//   numbers little endian
+class ChecksumOutput : public SidOutput {
+  public:
+    ChecksumOutput(SidOutput *sink) : inner(sink) {}
+
+    virtual ~ChecksumOutput() { delete inner; }
+
+    virtual void setOptions(SidOutputOptions *options)
+    {
+      opts = options;
+      inner->setOptions(options);
+    }
+
+    virtual void preProcessing()
+    {
+      char filename[80];
+      snprintf(filename, sizeof(filename), "%s.sum", opts->songfilename);
+      if (!out.open(filename))
+        printf("Error: couldn't write %s\n", filename);
+      out.write("SDCK\1\0\0\0", 8);
+      inner->preProcessing();
+    }
+
+    virtual void processCurrentFrame(const SidState &current)
+    {
+      checksum = frameChecksum(checksum, current.packed);
+      unsigned char bytes[4] = {(unsigned char)checksum, (unsigned char)(checksum >> 8),
+                                (unsigned char)(checksum >> 16), (unsigned char)(checksum >> 24)};
+      out.write(bytes, 4);
+      inner->processCurrentFrame(current);
+    }
+
+    virtual void flush()
+    {
+      inner->flush();
+      out.flush();
+    }
+
+    virtual unsigned long long bytesWritten() { return inner->bytesWritten(); }
+
+    virtual void postProcessing()
+    {
+      inner->postProcessing();
+      out.close();
+    }
+
+  private:
+    SidOutput *inner;
+    OutputWriter out;
+    uint32_t checksum = 0;
+};
+
+// Compares two dumps of output mode 2, 4 or 6, or two checksum sidecars,
+// and reports the first frame (and for dumps the register) that differs.
+class DumpCompare {
+  public:
+    enum Result { SAME = 0, DIFFERENT = 1, FAILED = 2 };
+
+    // mode is the output mode the dumps were written with; checksum files
+    // are recognised by their header whatever it is
+    Result run(const char *filename1, const char *filename2, int mode)
+    {
+      const char *names[2] = {filename1, filename2};
+      for (int i = 0; i < 2; i++)
+        if (!files[i].open(names[i]))
+        {
+          printf("Error: couldn't read %s\n", names[i]);
+          return FAILED;
+        }
+      if (isChecksums(files[0]) && isChecksums(files[1]))
+        return compareFixed(4, 8, false);
+      if (mode == 2)
+        return compareFixed(25, 0, true);
+      if (mode == 4)
+        return compareFixed(27, 0, true);
+      if (mode == 6)
+        return compareChanges();
+      printf("Error: can only compare dumps of mode 2, 4 or 6 (-m) or checksum files\n");
+      return FAILED;
+    }
+
+  private:
+    static bool isChecksums(const MappedFile &file)
+    {
+      return file.size >= 8 && !memcmp(file.data, "SDCK\1\0\0\0", 8);
+    }
+
+    // frames of size bytes after a header
+    Result compareFixed(size_t size, size_t header, bool registers)
+    {
+      const unsigned char *a = files[0].data + header, *b = files[1].data + header;
+      size_t lengtha = files[0].size - header, lengthb = files[1].size - header;
+      size_t common = lengtha < lengthb ? lengtha : lengthb;
+      size_t at = firstDifference(a, b, common - common % size);
+      if (at < common - common % size)
+      {
+        size_t frame = at / size;
+        if (registers)
+          report(frame, at % size, a[at], b[at]);
+        else
+          printf("Compare: first difference at frame %u\n", (unsigned)frame);
+        return DIFFERENT;
+      }
+      return lengths(lengtha / size, lengthb / size);
+    }
+
+    // changes only dumps differ in length per frame: find the first byte
+    // that differs, then decode both up to it to see which frame and
+    // register it belongs to. A frame differs where a register's value or
+    // whether it is written at all does, so two dumps that differ are never
+    // reported the same.
+    Result compareChanges()
+    {
+      const unsigned char *a = files[0].data, *b = files[1].data;
+      size_t common = files[0].size < files[1].size ? files[0].size : files[1].size;
+      size_t at = firstDifference(a, b, common);
+      if (at == common)
+        return lengths(count(files[0], 0), count(files[1], 0));
+
+      unsigned char rega[27] = {0}, regb[27] = {0};
+      size_t posa = 0, posb = 0;
+      unsigned int frame = 0;
+      // identical up to at, so both frames start at the same offsets
+      while (posa < files[0].size && posb < files[1].size)
+      {
+        uint32_t writtena, writtenb;
+        if (!apply(files[0], posa, rega, writtena) || !apply(files[1], posb, regb, writtenb))
+        {
+          printf("Error: dump is cut off in frame %u\n", frame);
+          return FAILED;
+        }
+        if (posa > at || posb > at)
+        {
+          uint32_t differs = writtena ^ writtenb;
+          for (int r = 0; r < 27; r++)
+            if (rega[r] != regb[r])
+              differs |= 1u << r;
+          if (differs)
+          {
+            int r = __builtin_ctz(differs);
+            report(frame, r, rega[r], regb[r]);
+            if (rega[r] == regb[r])
+              printf("Compare: the register is written in frame %u of only one of them\n", frame);
+            return DIFFERENT;
+          }
+          // the bytes differ where the registers don't, e.g. in the order
+          // they are written in
+          printf("Compare: first difference at frame %u, byte %u\n", frame, (unsigned)at);
+          return DIFFERENT;
+        }
+        frame++;
+      }
+      printf("Compare: first difference at frame %u, byte %u\n", frame, (unsigned)at);
+      return DIFFERENT;
+    }
+
+    // the next frame of a changes only dump into regs, the registers it
+    // writes into written; false if it is cut off
+    static bool apply(const MappedFile &file, size_t &pos, unsigned char *regs, uint32_t &written)
+    {
+      unsigned int n = file.data[pos++];
+      written = 0;
+      if (pos + n * 2 > file.size)
+        return false;
+      for (unsigned int i = 0; i < n; i++, pos += 2)
+        if (file.data[pos] < 27)
+        {
+          regs[file.data[pos]] = file.data[pos + 1];
+          written |= 1u << file.data[pos];
+        }
+      return true;
+    }
+
+    // frames left from pos
+    static unsigned int count(const MappedFile &file, size_t pos)
+    {
+      unsigned int frames = 0;
+      for (; pos < file.size; frames++)
+        pos += 1 + file.data[pos] * 2;
+      return frames;
+    }
+
+    Result lengths(size_t framesa, size_t framesb)
+    {
+      if (framesa != framesb)
+      {
+        printf("Compare: same for %u frames, then only one of them goes on (%u and %u frames)\n",
+          (unsigned)(framesa < framesb ? framesa : framesb), (unsigned)framesa, (unsigned)framesb);
+        return DIFFERENT;
+      }
+      printf("Compare: same, %u frames\n", (unsigned)framesa);
+      return SAME;
+    }
+
+    static void report(size_t frame, size_t reg, unsigned a, unsigned b)
+    {
+      if (reg < 25)
+        printf("Compare: first difference at frame %u, register $D4%02X: $%02X and $%02X\n", (unsigned)frame,
+          (unsigned)reg, a, b);
+      else
+        printf("Compare: first difference at frame %u, frame time %s: $%02X and $%02X\n", (unsigned)frame,
+          reg == 25 ? "high" : "low", a, b);
+    }
+
+    MappedFile files[2];
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include "cpu.h"
+
+// Identifies the music driver (player engine) of a tune by its playroutine.
+// Most tunes use one of a few dozen stock drivers, and tunes made with the
+// same one have the same code at the play address.
+//
+// The fingerprint hashes the instructions from the play address along the
+// path taken when no branch is: opcodes and one byte operands (immediates,
+// zero page addresses, branch offsets), but not absolute addresses, so a
+// driver relocated to another address still matches. A JMP is followed,
+// the walk ends at an RTS/RTI, an indirect jump or after 64 instructions.
+static inline uint64_t engineFingerprint(const unsigned char *mem, unsigned playaddress)
+{
+  static const int MAX_INSTRUCTIONS = 64;
+  uint64_t h = 1469598103934665603ull;
+  unsigned pc = playaddress & 0xffff;
+  for (int i = 0; i < MAX_INSTRUCTIONS; i++)
+  {
+    unsigned char op = mem[pc];
+    int length = opcodelength(op);
+    h = (h ^ op) * 1099511628211ull;
+    if (!length || pc + length > 0x10000 || op == 0x00 || op == 0x40 || op == 0x60 || op == 0x6c)
+      break;
+    if (length == 2)
+      h = (h ^ mem[pc + 1]) * 1099511628211ull;
+    if (op == 0x4c)
+      pc = mem[pc + 1] | (mem[pc + 2] << 8);
+    else
+      pc += length;
+  }
+  return h;
+}
+
+// Engine names by fingerprint, from a text file with a line per engine:
+//   <fingerprint, 16 hex digits> <name>
+// Lines starting with # are comments.
+class EngineDatabase {
+  public:
+    // false if the file couldn't be read
+    bool load(const char *filename)
+    {
+      FILE *in = fopen(filename, "r");
+      if (!in)
+        return false;
+      char line[256];
+      while (fgets(line, sizeof(line), in))
+      {
+        unsigned long long fingerprint;
+        int length = 0;
+        if (line[0] == '#' || sscanf(line, "%llx %n", &fingerprint, &length) != 1 || !length)
+          continue;
+        line[strcspn(line, "\r\n")] = 0;
+        names[fingerprint] = &line[length];
+      }
+      fclose(in);
+      return true;
+    }
+
+    // the engine's name, NULL if it isn't known
+    const char *identify(uint64_t fingerprint) const
+    {
+      auto it = names.find(fingerprint);
+      return it == names.end() ? NULL : it->second.c_str();
+    }
+
+  private:
+    std::unordered_map<uint64_t, std::string> names;
+};
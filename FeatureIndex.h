@@ -0,0 +1,539 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "SidOutput.h"
+#include "SidDumpReader.h"
+
+// What a tune does with the SID, as features a corpus of tunes can be
+// searched by: waveforms, sync, ring and test bit and filter routing per
+// voice, filter modes and resonance, ADSR classes of the notes played,
+// the octaves they are in, and whether the playroutine runs from the
+// vertical blank (VBI) or a CIA timer, as sidreg[25..26] has it.
+namespace Features {
+  enum
+  {
+    // per voice, VOICE_FEATURES apart
+    TRIANGLE, SAW, PULSE, NOISE, SYNC, RING, TEST, FILTERED, VOICE_FEATURES,
+    LOWPASS = VOICE_FEATURES * 3, BANDPASS, HIGHPASS, RESONANCE,
+    FAST_ATTACK, SLOW_ATTACK, NO_SUSTAIN, FULL_SUSTAIN, FAST_RELEASE, SLOW_RELEASE,
+    OCTAVE0,
+    VBI = OCTAVE0 + 8, CIA, MULTISPEED,
+    COUNT
+  };
+
+  // name of a feature, with the voice (1-3) appended for voice features
+  static std::string name(int feature)
+  {
+    static const char *const voicenames[VOICE_FEATURES] = {
+      "triangle", "saw", "pulse", "noise", "sync", "ring", "test", "filtered"};
+    static const char *const names[] = {
+      "lowpass", "bandpass", "highpass", "resonance",
+      "fastattack", "slowattack", "nosustain", "fullsustain", "fastrelease", "slowrelease"};
+    char buffer[16];
+    if (feature < LOWPASS)
+      snprintf(buffer, sizeof(buffer), "%s%d", voicenames[feature % VOICE_FEATURES], feature / VOICE_FEATURES + 1);
+    else if (feature < OCTAVE0)
+      return names[feature - LOWPASS];
+    else if (feature < VBI)
+      snprintf(buffer, sizeof(buffer), "octave%d", feature - OCTAVE0);
+    else
+      return feature == VBI ? "vbi" : feature == CIA ? "cia" : "multispeed";
+    return buffer;
+  }
+}
+
+// Inverted index of tunes by feature.
+//
+// File, numbers little endian: "SDIX", u32 version (2), u32 offset of the
+// log, u32 tunes, u32 features, per tune u16 name length, name and u16
+// subtune, then per feature u32 byte length and the tunes that have it as
+// a posting list of varint coded gaps. The log follows: per tune added
+// since, u16 name length, name, u16 subtune and u64 feature bits.
+//
+// A run appends its tune to the log with one write() under an exclusive
+// lock, so batch jobs can share one index. Once the log is as large as
+// the posting lists before it, the run that finds it so compacts the file,
+// merging the log into the posting lists; as the file doubles in between,
+// each tune is rewritten a constant number of times on average. A tune
+// indexed again replaces its entry.
+class FeatureIndex {
+  public:
+    struct Tune
+    {
+      std::string name;
+      int subtune;
+      uint64_t features;
+    };
+
+    // false if the file couldn't be read or written
+    static bool add(const char *filename, const Tune &tune)
+    {
+      int fd = open(filename, O_RDWR | O_CREAT, 0644);
+      if (fd < 0)
+        return false;
+      std::vector<unsigned char> record = encodeRecord(tune);
+      struct stat st;
+      unsigned char header[20];
+      bool ok = flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0;
+      if (ok && st.st_size == 0)
+      {
+        // a new file starts with empty posting lists
+        std::vector<unsigned char> data = FeatureIndex().encode();
+        data.insert(data.end(), record.begin(), record.end());
+        ok = pwrite(fd, data.data(), data.size(), 0) == (ssize_t)data.size();
+      }
+      else if (ok)
+      {
+        ok = pread(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+          !memcmp(header, "SDIX\2\0\0\0", 8);
+        size_t logoffset = ok ? get32(&header[8]) : 0;
+        ok = ok && logoffset >= sizeof(header) && logoffset <= (size_t)st.st_size;
+        if (ok && st.st_size - logoffset + record.size() < logoffset)
+          ok = pwrite(fd, record.data(), record.size(), st.st_size) == (ssize_t)record.size();
+        else if (ok)
+        {
+          FeatureIndex index;
+          std::vector<unsigned char> data;
+          ok = readAll(fd, data) && index.decode(data);
+          if (ok)
+          {
+            index.insert(tune);
+            data = index.encode();
+            ok = pwrite(fd, data.data(), data.size(), 0) == (ssize_t)data.size() &&
+              ftruncate(fd, data.size()) == 0;
+          }
+        }
+      }
+      return close(fd) == 0 && ok;
+    }
+
+    // false if the file isn't an index
+    bool load(const char *filename)
+    {
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0)
+        return false;
+      std::vector<unsigned char> data;
+      bool ok = flock(fd, LOCK_SH) == 0 && readAll(fd, data) && decode(data);
+      close(fd);
+      return ok;
+    }
+
+    // print the tunes matching a query of feature names, & (and), |
+    // (or), ! (not) and parentheses; a voice feature without its voice
+    // number means on any voice. False if the query doesn't parse.
+    bool query(const char *expression)
+    {
+      auto start = std::chrono::steady_clock::now();
+      text = expression;
+      pos = 0;
+      error.clear();
+      Bitmap result = parseOr();
+      skipSpaces();
+      if (error.empty() && text[pos])
+        error = std::string("unexpected ") + &text[pos];
+      if (!error.empty())
+      {
+        printf("Error: %s in query\n", error.c_str());
+        return false;
+      }
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      unsigned int matches = 0;
+      for (size_t i = 0; i < tunes.size(); i++)
+        if (result[i / 64] >> (i % 64) & 1)
+        {
+          printf("%s #%d\n", tunes[i].name.c_str(), tunes[i].subtune);
+          matches++;
+        }
+      printf("Query: %u of %u tunes, %.3f ms\n", matches, (unsigned)tunes.size(), ms);
+      return true;
+    }
+
+  private:
+    typedef std::vector<uint64_t> Bitmap;
+
+    static bool readAll(int fd, std::vector<unsigned char> &dest)
+    {
+      unsigned char buffer[65536];
+      ssize_t n;
+      while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        dest.insert(dest.end(), buffer, buffer + n);
+      return n == 0;
+    }
+
+    static void put(std::vector<unsigned char> &dest, uint64_t value, int bytes)
+    {
+      for (int i = 0; i < bytes; i++)
+        dest.push_back(value >> (i * 8));
+    }
+
+    static std::vector<unsigned char> encodeRecord(const Tune &tune)
+    {
+      std::vector<unsigned char> out;
+      size_t length = tune.name.size() < 0xffff ? tune.name.size() : 0xffff;
+      put(out, length, 2);
+      out.insert(out.end(), tune.name.begin(), tune.name.begin() + length);
+      put(out, tune.subtune, 2);
+      put(out, tune.features, 8);
+      return out;
+    }
+
+    static std::string key(const Tune &tune) { return tune.name + '\0' + std::to_string(tune.subtune); }
+
+    // the posting lists into a bitmap per feature, then the log on top
+    bool decode(const std::vector<unsigned char> &data)
+    {
+      if (data.size() < 20 || memcmp(data.data(), "SDIX\2\0\0\0", 8))
+        return false;
+      size_t logoffset = get32(&data[8]), count = get32(&data[12]), features = get32(&data[16]);
+      if (logoffset > data.size())
+        return false;
+      size_t p = 20;
+      tunes.resize(count);
+      for (size_t i = 0; i < count; i++)
+      {
+        if (p + 2 > logoffset)
+          return false;
+        size_t length = data[p] | (data[p + 1] << 8);
+        if (p + 4 + length > logoffset)
+          return false;
+        tunes[i].name.assign((const char *)&data[p + 2], length);
+        tunes[i].subtune = data[p + 2 + length] | (data[p + 3 + length] << 8);
+        tunes[i].features = 0;
+        entries[key(tunes[i])] = i;
+        p += 4 + length;
+      }
+      postings.assign(Features::COUNT, Bitmap((count + 63) / 64));
+      for (size_t f = 0; f < features; f++)
+      {
+        if (p + 4 > logoffset)
+          return false;
+        size_t end = p + 4 + get32(&data[p]);
+        if (end > logoffset)
+          return false;
+        size_t tune = 0;
+        for (p += 4; p < end; tune++)
+        {
+          uint32_t gap = 0;
+          for (int shift = 0; p < end; shift += 7)
+          {
+            gap |= (data[p] & 0x7f) << shift;
+            if (!(data[p++] & 0x80))
+              break;
+          }
+          tune += gap;
+          if (tune >= count)
+            return false;
+          // features this build doesn't know stay in no posting list
+          if (f < Features::COUNT)
+          {
+            postings[f][tune / 64] |= 1ull << (tune % 64);
+            tunes[tune].features |= 1ull << f;
+          }
+        }
+      }
+
+      uint64_t known = Features::COUNT < 64 ? (1ull << Features::COUNT) - 1 : ~0ull;
+      for (p = logoffset; p < data.size(); )
+      {
+        if (p + 2 > data.size())
+          return false;
+        size_t length = data[p] | (data[p + 1] << 8);
+        if (p + 12 + length > data.size())
+          return false;
+        Tune tune;
+        tune.name.assign((const char *)&data[p + 2], length);
+        p += 2 + length;
+        tune.subtune = data[p] | (data[p + 1] << 8);
+        tune.features = (get32(&data[p + 2]) | ((uint64_t)get32(&data[p + 6]) << 32)) & known;
+        p += 10;
+        insert(tune);
+      }
+      return true;
+    }
+
+    // add a tune or replace its entry, keeping the bitmaps up to date
+    void insert(const Tune &tune)
+    {
+      auto found = entries.find(key(tune));
+      size_t i = found != entries.end() ? found->second : tunes.size();
+      if (i == tunes.size())
+      {
+        entries[key(tune)] = i;
+        tunes.push_back(tune);
+        for (size_t f = 0; f < postings.size(); f++)
+          postings[f].resize((tunes.size() + 63) / 64);
+      }
+      tunes[i].features = tune.features;
+      for (size_t f = 0; f < postings.size(); f++)
+      {
+        postings[f][i / 64] &= ~(1ull << (i % 64));
+        postings[f][i / 64] |= (tune.features >> f & 1) << (i % 64);
+      }
+    }
+
+    std::vector<unsigned char> encode() const
+    {
+      std::vector<unsigned char> out;
+      out.insert(out.end(), "SDIX\2\0\0\0", "SDIX\2\0\0\0" + 8);
+      put(out, 0, 4);
+      put(out, tunes.size(), 4);
+      put(out, Features::COUNT, 4);
+      for (size_t i = 0; i < tunes.size(); i++)
+      {
+        size_t length = tunes[i].name.size() < 0xffff ? tunes[i].name.size() : 0xffff;
+        put(out, length, 2);
+        out.insert(out.end(), tunes[i].name.begin(), tunes[i].name.begin() + length);
+        put(out, tunes[i].subtune, 2);
+      }
+      for (int f = 0; f < Features::COUNT; f++)
+      {
+        size_t at = out.size();
+        put(out, 0, 4);
+        size_t next = 0;
+        for (size_t i = 0; i < tunes.size(); i++)
+          if (tunes[i].features >> f & 1)
+          {
+            for (uint32_t gap = i - next; ; gap >>= 7)
+            {
+              out.push_back((gap & 0x7f) | (gap >= 0x80 ? 0x80 : 0));
+              if (gap < 0x80)
+                break;
+            }
+            next = i + 1;
+          }
+        uint32_t length = out.size() - at - 4;
+        for (int b = 0; b < 4; b++)
+          out[at + b] = length >> (b * 8);
+      }
+      // the log starts where the posting lists end
+      for (int b = 0; b < 4; b++)
+        out[8 + b] = out.size() >> (b * 8);
+      return out;
+    }
+
+    void skipSpaces()
+    {
+      while (isspace((unsigned char)text[pos]))
+        pos++;
+    }
+
+    // an operator, as a symbol or a word
+    bool accept(char symbol, const char *word)
+    {
+      skipSpaces();
+      if (text[pos] == symbol)
+      {
+        pos++;
+        return true;
+      }
+      size_t length = strlen(word);
+      if (!strncasecmp(&text[pos], word, length) && !isalnum((unsigned char)text[pos + length]))
+      {
+        pos += length;
+        return true;
+      }
+      return false;
+    }
+
+    Bitmap parseOr()
+    {
+      Bitmap result = parseAnd();
+      while (error.empty() && accept('|', "or"))
+      {
+        Bitmap right = parseAnd();
+        for (size_t w = 0; w < result.size(); w++)
+          result[w] |= right[w];
+      }
+      return result;
+    }
+
+    Bitmap parseAnd()
+    {
+      Bitmap result = parseNot();
+      while (error.empty() && accept('&', "and"))
+      {
+        Bitmap right = parseNot();
+        for (size_t w = 0; w < result.size(); w++)
+          result[w] &= right[w];
+      }
+      return result;
+    }
+
+    Bitmap parseNot()
+    {
+      if (!accept('!', "not"))
+        return parsePrimary();
+      Bitmap result = parseNot();
+      for (size_t w = 0; w < result.size(); w++)
+        result[w] = ~result[w];
+      if (tunes.size() % 64)
+        result.back() &= (1ull << (tunes.size() % 64)) - 1;
+      return result;
+    }
+
+    Bitmap parsePrimary()
+    {
+      Bitmap result((tunes.size() + 63) / 64);
+      if (accept('(', "("))
+      {
+        result = parseOr();
+        if (error.empty() && !accept(')', ")"))
+          error = "missing )";
+        return result;
+      }
+      size_t start = pos;
+      while (isalnum((unsigned char)text[pos]))
+        pos++;
+      std::string word(&text[start], pos - start);
+      bool found = false;
+      for (int f = 0; f < Features::COUNT; f++)
+      {
+        std::string name = Features::name(f);
+        // "ring" is ring1 | ring2 | ring3
+        bool anyvoice = f < Features::LOWPASS && name.compare(0, name.size() - 1, word) == 0 &&
+          word.size() == name.size() - 1;
+        if (name == word || anyvoice)
+        {
+          for (size_t w = 0; w < result.size(); w++)
+            result[w] |= postings[f][w];
+          found = true;
+        }
+      }
+      if (!found && error.empty())
+        error = word.empty() ? std::string("feature expected") : "unknown feature " + word;
+      return result;
+    }
+
+    std::vector<Tune> tunes;
+    std::unordered_map<std::string, size_t> entries;
+    std::vector<Bitmap> postings;
+    const char *text = "";
+    size_t pos = 0;
+    std::string error;
+};
+
+// Collects the features of the frames a dump goes through, next to
+// whatever the wrapped output does, and adds the tune to an index file.
+class FeatureOutput : public SidOutput {
+  public:
+    FeatureOutput(SidOutput *sink, const char *filename, const char *tunename, int subtune)
+      : inner(sink), filename(filename), tunename(tunename), subtune(subtune) {}
+
+    virtual ~FeatureOutput()
+    {
+      delete inner;
+      delete notes;
+    }
+
+    virtual void setOptions(SidOutputOptions *options)
+    {
+      opts = options;
+      inner->setOptions(options);
+    }
+
+    virtual void preProcessing()
+    {
+      notes = new NoteTable;
+      ScreenOutputWithNotes::buildNoteTable(*notes, opts);
+      inner->preProcessing();
+    }
+
+    virtual void processCurrentFrame(const SidState &current)
+    {
+      using namespace Features;
+      unsigned char ctrl = current.filt.ctrl, type = current.filt.type;
+      for (int v = 0; v < 3; v++)
+      {
+        const Voice &voice = current.voice[v];
+        int base = v * VOICE_FEATURES;
+        if (voice.wave >= 0x10)
+        {
+          for (int w = 0; w < 4; w++)
+            if (voice.wave & (0x10 << w))
+              set(base + TRIANGLE + w);
+          // ring modulation only sounds on triangle
+          if ((voice.wave & 0x14) == 0x14)
+            set(base + RING);
+          if (voice.wave & 2)
+            set(base + SYNC);
+          if ((ctrl & (1 << v)) && (type & 0x70))
+            set(base + FILTERED);
+          note(v, voice);
+        }
+        if (voice.wave & 8)
+          set(base + TEST);
+        wave[v] = voice.wave;
+      }
+      if ((ctrl & 7) && (type & 0x70))
+      {
+        for (int m = 0; m < 3; m++)
+          if (type & (0x10 << m))
+            set(LOWPASS + m);
+        if (ctrl >= 0x80)
+          set(RESONANCE);
+      }
+      unsigned int dt = (current.sidreg[25] << 8) | current.sidreg[26];
+      set(dt == 0x4e20 ? VBI : CIA);
+      if (dt < 15000)
+        set(MULTISPEED);
+      inner->processCurrentFrame(current);
+    }
+
+    virtual void flush() { inner->flush(); }
+
+    virtual unsigned long long bytesWritten() { return inner->bytesWritten(); }
+
+    virtual void postProcessing()
+    {
+      inner->postProcessing();
+      FeatureIndex::Tune tune = {tunename, subtune, features};
+      if (!FeatureIndex::add(filename, tune))
+        printf("Error: couldn't update %s\n", filename);
+    }
+
+  private:
+    void set(int feature) { features |= 1ull << feature; }
+
+    // the ADSR class of a note at its gate on and the octave of every
+    // note, found as the listing does
+    void note(int v, const Voice &voice)
+    {
+      using namespace Features;
+      bool keyon = (voice.wave & 1) && (!(wave[v] & 1) || wave[v] < 0x10);
+      if (keyon)
+      {
+        sticky[v] = NoteTable::NO_NOTE;
+        unsigned int attack = voice.adsr >> 12, sustain = (voice.adsr >> 4) & 15, release = voice.adsr & 15;
+        if (attack <= 1) set(FAST_ATTACK);
+        if (attack >= 8) set(SLOW_ATTACK);
+        if (sustain == 0) set(NO_SUSTAIN);
+        if (sustain == 15) set(FULL_SUSTAIN);
+        if (release <= 1) set(FAST_RELEASE);
+        if (release >= 8) set(SLOW_RELEASE);
+      }
+      sticky[v] = notes->find(voice.freq, sticky[v]);
+      if (sticky[v] >= 0 && sticky[v] < 96)
+        set(OCTAVE0 + sticky[v] / 12);
+    }
+
+    SidOutput *inner;
+    const char *filename;
+    const char *tunename;
+    int subtune;
+    NoteTable *notes = NULL;
+    unsigned char wave[3] = {0};
+    int sticky[3] = {NoteTable::NO_NOTE, NoteTable::NO_NOTE, NoteTable::NO_NOTE};
+    uint64_t features = 0;
+};
@@ -0,0 +1,289 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "SidOutput.h"
+#include "SidDumpReader.h"
+
+// MinHash sketch of what a tune plays, to find re-releases, covers and
+// relocated copies of the same music. The notes are derived as the note
+// listing (ScreenOutputWithNotes) does; each new note of a voice becomes a
+// token of its interval to the voice's previous note, waveform and ADSR,
+// so a transposed copy gives the same tokens. Every run of SHINGLE tokens
+// of a voice is a shingle, and the sketch keeps the smallest hash of all
+// shingles under each of HASHES hash functions: the share of equal
+// values in two sketches estimates how many shingles the tunes share.
+class TuneSketch {
+  public:
+    static const int HASHES = 128;
+    static const int SHINGLE = 4;
+
+    TuneSketch() { std::fill(mins, mins + HASHES, 0xffffffffu); }
+
+    void add(uint64_t shingle)
+    {
+      shingles++;
+      for (int i = 0; i < HASHES; i++)
+      {
+        uint32_t h = (uint32_t)(mix(shingle ^ seed(i)) >> 32);
+        if (h < mins[i])
+          mins[i] = h;
+      }
+    }
+
+    // estimated Jaccard similarity of the two tunes' shingle sets
+    double similarity(const TuneSketch &other) const
+    {
+      int same = 0;
+      for (int i = 0; i < HASHES; i++)
+        same += mins[i] == other.mins[i];
+      return same / (double)HASHES;
+    }
+
+    static uint64_t mix(uint64_t x)
+    {
+      x ^= x >> 30;
+      x *= 0xbf58476d1ce4e5b9ull;
+      x ^= x >> 27;
+      x *= 0x94d049bb133111ebull;
+      x ^= x >> 31;
+      return x;
+    }
+
+    uint32_t mins[HASHES];
+    unsigned int shingles = 0;
+
+  private:
+    static uint64_t seed(int i) { return mix(0x9e3779b97f4a7c15ull * (i + 1)); }
+};
+
+// Builds the sketch from the frames a dump goes through, next to whatever
+// the wrapped output does, and appends it to the fingerprint file.
+//
+// Fingerprint file, numbers little endian: "SDFP", u32 version (1), then
+// per tune: u16 name length, name, u16 subtune, u32 shingles, 128 u32
+// sketch values. Runs append with a single write() under an exclusive
+// lock, so batch jobs can share one file.
+class FingerprintOutput : public SidOutput {
+  public:
+    FingerprintOutput(SidOutput *sink, const char *filename, const char *tunename, int subtune)
+      : inner(sink), filename(filename), tunename(tunename), subtune(subtune) {}
+
+    virtual ~FingerprintOutput()
+    {
+      delete inner;
+      delete notes;
+    }
+
+    virtual void setOptions(SidOutputOptions *options)
+    {
+      opts = options;
+      inner->setOptions(options);
+    }
+
+    virtual void preProcessing()
+    {
+      notes = new NoteTable;
+      ScreenOutputWithNotes::buildNoteTable(*notes, opts);
+      inner->preProcessing();
+    }
+
+    virtual void processCurrentFrame(const SidState &current)
+    {
+      for (int v = 0; v < 3; v++)
+        voice(v, current.voice[v]);
+      inner->processCurrentFrame(current);
+    }
+
+    virtual void flush() { inner->flush(); }
+
+    virtual unsigned long long bytesWritten() { return inner->bytesWritten(); }
+
+    virtual void postProcessing()
+    {
+      inner->postProcessing();
+      if (!save())
+        printf("Error: couldn't write %s\n", filename);
+    }
+
+  private:
+    struct VoiceState
+    {
+      int sticky = NoteTable::NO_NOTE;  // note as the listing has it
+      int last = NoteTable::NO_NOTE;    // previous note played
+      unsigned char wave = 0;
+      uint64_t tokens[TuneSketch::SHINGLE] = {0};
+      unsigned int count = 0;
+    };
+
+    // a gate on, or a note change while sounding, plays a new note
+    void voice(int v, const Voice &current)
+    {
+      VoiceState &s = voices[v];
+      if (current.wave >= 0x10)
+      {
+        bool keyon = (current.wave & 1) && (!(s.wave & 1) || s.wave < 0x10);
+        if (keyon)
+          s.sticky = NoteTable::NO_NOTE;
+        int note = notes->find(current.freq, s.sticky);
+        if (keyon || note != s.sticky)
+          played(s, note, current);
+        s.sticky = note;
+      }
+      s.wave = current.wave;
+    }
+
+    void played(VoiceState &s, int note, const Voice &current)
+    {
+      int interval = s.last == NoteTable::NO_NOTE ? 0x7f : note - s.last;
+      s.last = note;
+      uint64_t token = (uint64_t)(interval & 0xff) | ((uint64_t)(current.wave & 0xf0) << 4) |
+        ((uint64_t)current.adsr << 16);
+      s.tokens[s.count++ % TuneSketch::SHINGLE] = token;
+      if (s.count < (unsigned)TuneSketch::SHINGLE)
+        return;
+      uint64_t shingle = 0;
+      for (int i = 0; i < TuneSketch::SHINGLE; i++)
+        shingle = TuneSketch::mix(shingle ^ s.tokens[(s.count + i) % TuneSketch::SHINGLE]);
+      sketch.add(shingle);
+    }
+
+    bool save()
+    {
+      int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (fd < 0)
+        return false;
+      std::vector<unsigned char> record;
+      struct stat st;
+      // the lock makes sure only the first run writes the header
+      bool ok = flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0;
+      if (ok && st.st_size == 0)
+        record.insert(record.end(), "SDFP\1\0\0\0", "SDFP\1\0\0\0" + 8);
+      size_t length = strlen(tunename) < 0xffff ? strlen(tunename) : 0xffff;
+      put(record, length, 2);
+      record.insert(record.end(), tunename, tunename + length);
+      put(record, subtune, 2);
+      put(record, sketch.shingles, 4);
+      for (int i = 0; i < TuneSketch::HASHES; i++)
+        put(record, sketch.mins[i], 4);
+      ok = ok && write(fd, record.data(), record.size()) == (ssize_t)record.size();
+      return close(fd) == 0 && ok;
+    }
+
+    static void put(std::vector<unsigned char> &dest, uint32_t value, int bytes)
+    {
+      for (int i = 0; i < bytes; i++)
+        dest.push_back(value >> (i * 8));
+    }
+
+    SidOutput *inner;
+    const char *filename;
+    const char *tunename;
+    int subtune;
+    NoteTable *notes = NULL;
+    VoiceState voices[3];
+    TuneSketch sketch;
+};
+
+// Near-duplicates among the tunes of a fingerprint file, by locality
+// sensitive hashing: the sketch is cut into BANDS bands of ROWS values,
+// and only tunes that agree on all values of some band are compared. Two
+// tunes with similarity s share a band with probability
+// 1 - (1 - s^ROWS)^BANDS, 87% at s = 0.5 and over 99.9% from s = 0.75,
+// while most pairs of unrelated tunes are never looked at.
+class FingerprintIndex {
+  public:
+    static const int ROWS = 4;
+    static const int BANDS = TuneSketch::HASHES / ROWS;
+
+    struct Entry
+    {
+      std::string name;
+      int subtune;
+      TuneSketch sketch;
+    };
+
+    // false if the file isn't a fingerprint file
+    bool load(const char *filename)
+    {
+      MappedFile file;
+      if (!file.open(filename) || file.size < 8 || memcmp(file.data, "SDFP\1\0\0\0", 8))
+        return false;
+      size_t pos = 8;
+      while (pos + 2 <= file.size)
+      {
+        size_t length = file.data[pos] | (file.data[pos + 1] << 8);
+        if (pos + 2 + length + 6 + TuneSketch::HASHES * 4 > file.size)
+          return false;
+        Entry entry;
+        entry.name.assign((const char *)&file.data[pos + 2], length);
+        pos += 2 + length;
+        entry.subtune = file.data[pos] | (file.data[pos + 1] << 8);
+        entry.sketch.shingles = get32(&file.data[pos + 2]);
+        pos += 6;
+        for (int i = 0; i < TuneSketch::HASHES; i++, pos += 4)
+          entry.sketch.mins[i] = get32(&file.data[pos]);
+        entries.push_back(entry);
+      }
+      return true;
+    }
+
+    // print the pairs with at least the given similarity, most similar
+    // first; tunes without notes have nothing to compare and are left out
+    void printDuplicates(double threshold)
+    {
+      std::vector<std::pair<double, std::pair<unsigned, unsigned> > > found;
+      std::unordered_map<uint64_t, std::vector<unsigned> > buckets;
+      std::unordered_map<uint64_t, bool> compared;
+      for (int band = 0; band < BANDS; band++)
+      {
+        buckets.clear();
+        for (unsigned i = 0; i < entries.size(); i++)
+          if (entries[i].sketch.shingles)
+            buckets[bandKey(entries[i].sketch, band)].push_back(i);
+        for (auto &bucket : buckets)
+        {
+          const std::vector<unsigned> &tunes = bucket.second;
+          for (size_t a = 0; a < tunes.size(); a++)
+            for (size_t b = a + 1; b < tunes.size(); b++)
+            {
+              uint64_t pair = ((uint64_t)tunes[a] << 32) | tunes[b];
+              if (compared[pair])
+                continue;
+              compared[pair] = true;
+              double s = entries[tunes[a]].sketch.similarity(entries[tunes[b]].sketch);
+              if (s >= threshold)
+                found.push_back(std::make_pair(s, std::make_pair(tunes[a], tunes[b])));
+            }
+        }
+      }
+      std::sort(found.rbegin(), found.rend());
+      for (size_t i = 0; i < found.size(); i++)
+      {
+        const Entry &a = entries[found[i].second.first], &b = entries[found[i].second.second];
+        printf("Duplicate: %.2f %s #%d, %s #%d\n", found[i].first, a.name.c_str(), a.subtune, b.name.c_str(),
+          b.subtune);
+      }
+      printf("Duplicates: %u pairs among %u tunes, %u pairs compared\n", (unsigned)found.size(),
+        (unsigned)entries.size(), (unsigned)compared.size());
+    }
+
+  private:
+    static uint64_t bandKey(const TuneSketch &sketch, int band)
+    {
+      uint64_t key = band;
+      for (int r = 0; r < ROWS; r++)
+        key = TuneSketch::mix(key ^ sketch.mins[band * ROWS + r]);
+      return key;
+    }
+
+    std::vector<Entry> entries;
+};
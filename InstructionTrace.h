@@ -0,0 +1,348 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "cpu.h"
+#include "SidDumpReader.h"
+
+// The last instructions a machine executed, kept in memory so there is
+// something to debug from when a tune halts or runs away. The driver
+// records the registers before every instruction it interprets; the ring
+// is saved only on an error or when asked for, and decodeTrace() prints a
+// saved one as a disassembly listing.
+//
+// Records are delta encoded: a mask byte says which of the program
+// counter, code bytes, A, X, Y, flags and stack pointer follow. The
+// program counter is left out when it follows on from the previous
+// instruction, the code bytes when the same address had the same ones
+// before in the block. The ring is made of blocks that each start from
+// scratch, so the oldest one can be overwritten and decoding starts at
+// any block. A mask with bit 7 set marks the start of an init or play
+// call instead, followed by the frame number.
+//
+// File, numbers little endian:
+//   "SDTR", u32 version (1), u32 block count, u64 instructions recorded
+//   per block, oldest first: u32 length, the records
+class InstructionTrace {
+  public:
+    enum Call { INIT = 0, PLAY = 1 };
+
+    static const unsigned int BLOCK = 4096;
+
+    InstructionTrace(unsigned int kilobytes = 1024)
+      : count(kilobytes * 1024 / BLOCK < 2 ? 2 : kilobytes * 1024 / BLOCK), data(count * BLOCK),
+        lengths(count), code(0x10000)
+    {
+      startBlock();
+    }
+
+    // an init or play call starts
+    void mark(Call call, unsigned int frame)
+    {
+      unsigned char *out = room();
+      out[0] = MARK | call;
+      for (int i = 0; i < 4; i++)
+        out[1 + i] = frame >> (i * 8);
+      fill += 5;
+    }
+
+    // the instruction at state.pc is about to run
+    void record(const CpuState &state)
+    {
+      // everything is read before the record is stored: stores through the
+      // byte pointer could alias the state and members, which would have
+      // to be read again after each one
+      unsigned char *out = room();
+      unsigned pc = state.pc;
+      unsigned char op = state.mem[pc];
+      unsigned char a = state.a, x = state.x, y = state.y, flags = state.flags, sp = state.sp;
+      int length = instructionLength(op);
+      static const uint32_t used[4] = {0, 0xff, 0xffff, 0xffffff};
+      uint64_t bytes = (op | (state.mem[(pc + 1) & 0xffff] << 8) | (state.mem[(pc + 2) & 0xffff] << 16)) & used[length];
+      Registers previous = last;
+      bytes |= (uint64_t)sequence << 32;
+      uint64_t &cached = code[pc];
+      bool sequential = pc == next;
+
+      unsigned char *p = out + 1;
+      unsigned mask = 0;
+      if (!sequential)
+      {
+        mask |= PC;
+        *p++ = pc;
+        *p++ = pc >> 8;
+      }
+      if (cached != bytes)
+      {
+        mask |= CODE;
+        cached = bytes;
+        for (int i = 0; i < length; i++)
+          *p++ = bytes >> (i * 8);
+      }
+      // which registers changed is hard to predict, so they are stored
+      // without branches: always written, kept only if different
+      p = changed(p, mask, A, a, previous.a);
+      p = changed(p, mask, X, x, previous.x);
+      p = changed(p, mask, Y, y, previous.y);
+      p = changed(p, mask, FLAGS, flags, previous.flags);
+      p = changed(p, mask, SP, sp, previous.sp);
+      *out = mask;
+      fill += p - out;
+      next = (pc + length) & 0xffff;
+      last.a = a;
+      last.x = x;
+      last.y = y;
+      last.flags = flags;
+      last.sp = sp;
+      recorded++;
+    }
+
+    // false if the file couldn't be written
+    bool save(const char *filename)
+    {
+      lengths[current] = fill;
+      FILE *out = fopen(filename, "wb");
+      if (!out)
+        return false;
+      unsigned int blocks = sequence < count ? sequence : count;
+      unsigned char header[20] = {'S', 'D', 'T', 'R', 1, 0, 0, 0};
+      put(&header[8], blocks, 4);
+      put(&header[12], recorded, 8);
+      fwrite(header, sizeof(header), 1, out);
+      for (unsigned int s = sequence - blocks + 1; s <= sequence; s++)
+      {
+        unsigned int b = s % count;
+        unsigned char length[4];
+        put(length, lengths[b], 4);
+        fwrite(length, 4, 1, out);
+        fwrite(&data[b * BLOCK], lengths[b], 1, out);
+      }
+      return fclose(out) == 0;
+    }
+
+    unsigned long long instructions() const { return recorded; }
+
+    // bytes an instruction takes, whether the CPU knows it or not
+    static int instructionLength(unsigned char op)
+    {
+      static const unsigned char lengths[256] = {
+        1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+        2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+        3, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+        2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+        1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+        2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+        1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+        2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+        2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+        2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+        2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+        2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+        2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+        2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+        2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+        2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+      };
+      return lengths[op];
+    }
+
+    enum Addressing { IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL };
+
+    static Addressing addressing(unsigned char op)
+    {
+      static const unsigned char modes[256] = {
+        IMP, IZX, IMP, IZX, ZP, ZP, ZP, ZP, IMP, IMM, ACC, IMM, ABS, ABS, ABS, ABS,
+        REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX, IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+        ABS, IZX, IMP, IZX, ZP, ZP, ZP, ZP, IMP, IMM, ACC, IMM, ABS, ABS, ABS, ABS,
+        REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX, IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+        IMP, IZX, IMP, IZX, ZP, ZP, ZP, ZP, IMP, IMM, ACC, IMM, ABS, ABS, ABS, ABS,
+        REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX, IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+        IMP, IZX, IMP, IZX, ZP, ZP, ZP, ZP, IMP, IMM, ACC, IMM, IND, ABS, ABS, ABS,
+        REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX, IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+        IMM, IZX, IMM, IZX, ZP, ZP, ZP, ZP, IMP, IMM, IMP, IMM, ABS, ABS, ABS, ABS,
+        REL, IZY, IMP, IZY, ZPX, ZPX, ZPY, ZPY, IMP, ABY, IMP, ABY, ABX, ABX, ABY, ABY,
+        IMM, IZX, IMM, IZX, ZP, ZP, ZP, ZP, IMP, IMM, IMP, IMM, ABS, ABS, ABS, ABS,
+        REL, IZY, IMP, IZY, ZPX, ZPX, ZPY, ZPY, IMP, ABY, IMP, ABY, ABX, ABX, ABY, ABY,
+        IMM, IZX, IMM, IZX, ZP, ZP, ZP, ZP, IMP, IMM, IMP, IMM, ABS, ABS, ABS, ABS,
+        REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX, IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+        IMM, IZX, IMM, IZX, ZP, ZP, ZP, ZP, IMP, IMM, IMP, IMM, ABS, ABS, ABS, ABS,
+        REL, IZY, IMP, IZY, ZPX, ZPX, ZPX, ZPX, IMP, ABY, IMP, ABY, ABX, ABX, ABX, ABX,
+      };
+      return (Addressing)modes[op];
+    }
+
+    static const char *mnemonic(unsigned char op)
+    {
+      static const char *const names[256] = {
+        "BRK", "ORA", "JAM", "SLO", "NOP", "ORA", "ASL", "SLO", "PHP", "ORA", "ASL", "ANC", "NOP", "ORA", "ASL", "SLO",
+        "BPL", "ORA", "JAM", "SLO", "NOP", "ORA", "ASL", "SLO", "CLC", "ORA", "NOP", "SLO", "NOP", "ORA", "ASL", "SLO",
+        "JSR", "AND", "JAM", "RLA", "BIT", "AND", "ROL", "RLA", "PLP", "AND", "ROL", "ANC", "BIT", "AND", "ROL", "RLA",
+        "BMI", "AND", "JAM", "RLA", "NOP", "AND", "ROL", "RLA", "SEC", "AND", "NOP", "RLA", "NOP", "AND", "ROL", "RLA",
+        "RTI", "EOR", "JAM", "SRE", "NOP", "EOR", "LSR", "SRE", "PHA", "EOR", "LSR", "ALR", "JMP", "EOR", "LSR", "SRE",
+        "BVC", "EOR", "JAM", "SRE", "NOP", "EOR", "LSR", "SRE", "CLI", "EOR", "NOP", "SRE", "NOP", "EOR", "LSR", "SRE",
+        "RTS", "ADC", "JAM", "RRA", "NOP", "ADC", "ROR", "RRA", "PLA", "ADC", "ROR", "ARR", "JMP", "ADC", "ROR", "RRA",
+        "BVS", "ADC", "JAM", "RRA", "NOP", "ADC", "ROR", "RRA", "SEI", "ADC", "NOP", "RRA", "NOP", "ADC", "ROR", "RRA",
+        "NOP", "STA", "NOP", "SAX", "STY", "STA", "STX", "SAX", "DEY", "NOP", "TXA", "ANE", "STY", "STA", "STX", "SAX",
+        "BCC", "STA", "JAM", "SHA", "STY", "STA", "STX", "SAX", "TYA", "STA", "TXS", "TAS", "SHY", "STA", "SHX", "SHA",
+        "LDY", "LDA", "LDX", "LAX", "LDY", "LDA", "LDX", "LAX", "TAY", "LDA", "TAX", "LXA", "LDY", "LDA", "LDX", "LAX",
+        "BCS", "LDA", "JAM", "LAX", "LDY", "LDA", "LDX", "LAX", "CLV", "LDA", "TSX", "LAS", "LDY", "LDA", "LDX", "LAX",
+        "CPY", "CMP", "NOP", "DCP", "CPY", "CMP", "DEC", "DCP", "INY", "CMP", "DEX", "SBX", "CPY", "CMP", "DEC", "DCP",
+        "BNE", "CMP", "JAM", "DCP", "NOP", "CMP", "DEC", "DCP", "CLD", "CMP", "NOP", "DCP", "NOP", "CMP", "DEC", "DCP",
+        "CPX", "SBC", "NOP", "ISC", "CPX", "SBC", "INC", "ISC", "INX", "SBC", "NOP", "SBC", "CPX", "SBC", "INC", "ISC",
+        "BEQ", "SBC", "JAM", "ISC", "NOP", "SBC", "INC", "ISC", "SED", "SBC", "NOP", "ISC", "NOP", "SBC", "INC", "ISC",
+      };
+      return names[op];
+    }
+
+    enum { PC = 1, CODE = 2, A = 4, X = 8, Y = 16, FLAGS = 32, SP = 64, MARK = 128 };
+
+    // longest record
+    static const unsigned int RECORD = 11;
+
+    // a value no register or address has
+    static const unsigned int NONE = 0x10000;
+
+  private:
+    // store a register, advance past it only if it changed
+    static unsigned char *changed(unsigned char *p, unsigned &mask, unsigned bit, unsigned value, unsigned last)
+    {
+      bool different = value != last;
+      *p = value;
+      mask |= different ? bit : 0;
+      return p + different;
+    }
+
+    // room for a record, in the next block if this one is full
+    unsigned char *room()
+    {
+      if (fill + RECORD > BLOCK)
+      {
+        lengths[current] = fill;
+        startBlock();
+      }
+      return &data[current * BLOCK + fill];
+    }
+
+    // a block starts with nothing known from before
+    void startBlock()
+    {
+      sequence++;
+      current = sequence % count;
+      fill = 0;
+      next = NONE;
+      last.a = last.x = last.y = last.flags = last.sp = NONE;
+    }
+
+    static void put(unsigned char *dest, unsigned long long value, int bytes)
+    {
+      for (int i = 0; i < bytes; i++)
+        dest[i] = value >> (i * 8);
+    }
+
+    struct Registers
+    {
+      unsigned int a, x, y, flags, sp;
+    };
+
+    unsigned int count;
+    std::vector<unsigned char> data;
+    std::vector<unsigned int> lengths;
+    // code bytes last recorded at an address, with the block sequence
+    // number above them
+    std::vector<uint64_t> code;
+    unsigned int current = 0;
+    unsigned int sequence = 0;
+    unsigned int fill = 0;
+    unsigned int next = NONE;
+    Registers last;
+    unsigned long long recorded = 0;
+};
+
+// Prints a saved trace as a disassembly listing with the registers before
+// each instruction; false if the file isn't a trace.
+static inline bool decodeTrace(const char *filename, FILE *out)
+{
+  MappedFile file;
+  if (!file.open(filename) || file.size < 20 || memcmp(file.data, "SDTR", 4) || file.data[4] != 1)
+    return false;
+  const unsigned char *p = file.data + 20;
+  const unsigned char *end = file.data + file.size;
+  unsigned int blocks = p[-12] | (p[-11] << 8) | (p[-10] << 16) | (p[-9] << 24);
+  std::vector<uint32_t> stamp(0x10000), code(0x10000);
+
+  for (unsigned int b = 1; b <= blocks; b++)
+  {
+    if (end - p < 4)
+      return false;
+    unsigned int length = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    p += 4;
+    if ((unsigned)(end - p) < length)
+      return false;
+    const unsigned char *blockend = p + length;
+    unsigned int pc = 0, a = 0, x = 0, y = 0, flags = 0, sp = 0;
+    while (p < blockend)
+    {
+      unsigned char mask = *p++;
+      if (mask & InstructionTrace::MARK)
+      {
+        unsigned int frame = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+        p += 4;
+        if ((mask & 1) == InstructionTrace::INIT)
+          fprintf(out, "; init\n");
+        else
+          fprintf(out, "; frame %u play\n", frame);
+        continue;
+      }
+      if (mask & InstructionTrace::PC)
+      {
+        pc = p[0] | (p[1] << 8);
+        p += 2;
+      }
+      if (mask & InstructionTrace::CODE)
+      {
+        int n = InstructionTrace::instructionLength(*p);
+        uint32_t bytes = 0;
+        for (int i = 0; i < n; i++)
+          bytes |= *p++ << (i * 8);
+        stamp[pc] = b;
+        code[pc] = bytes;
+      }
+      if (mask & InstructionTrace::A) a = *p++;
+      if (mask & InstructionTrace::X) x = *p++;
+      if (mask & InstructionTrace::Y) y = *p++;
+      if (mask & InstructionTrace::FLAGS) flags = *p++;
+      if (mask & InstructionTrace::SP) sp = *p++;
+      if (stamp[pc] != b)
+        return false;
+
+      unsigned char op = code[pc];
+      int n = InstructionTrace::instructionLength(op);
+      unsigned int operand = n == 3 ? (code[pc] >> 8) & 0xffff : (code[pc] >> 8) & 0xff;
+      char bytes[12] = "", text[16];
+      for (int i = 0; i < n; i++)
+        sprintf(&bytes[i * 3], "%02X ", (code[pc] >> (i * 8)) & 0xff);
+      switch (InstructionTrace::addressing(op))
+      {
+        case InstructionTrace::IMP: text[0] = 0; break;
+        case InstructionTrace::ACC: strcpy(text, "A"); break;
+        case InstructionTrace::IMM: sprintf(text, "#$%02X", operand); break;
+        case InstructionTrace::ZP: sprintf(text, "$%02X", operand); break;
+        case InstructionTrace::ZPX: sprintf(text, "$%02X,X", operand); break;
+        case InstructionTrace::ZPY: sprintf(text, "$%02X,Y", operand); break;
+        case InstructionTrace::ABS: sprintf(text, "$%04X", operand); break;
+        case InstructionTrace::ABX: sprintf(text, "$%04X,X", operand); break;
+        case InstructionTrace::ABY: sprintf(text, "$%04X,Y", operand); break;
+        case InstructionTrace::IND: sprintf(text, "($%04X)", operand); break;
+        case InstructionTrace::IZX: sprintf(text, "($%02X,X)", operand); break;
+        case InstructionTrace::IZY: sprintf(text, "($%02X),Y", operand); break;
+        case InstructionTrace::REL: sprintf(text, "$%04X", (pc + 2 + (signed char)operand) & 0xffff); break;
+      }
+      fprintf(out, "%04X  %-9s %s %-9s A=%02X X=%02X Y=%02X P=%02X S=%02X\n", pc, bytes,
+        InstructionTrace::mnemonic(op), text, a, x, y, flags, sp);
+      pc = (pc + n) & 0xffff;
+    }
+    p = blockend;
+  }
+  return true;
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// Loop aware encoding of a register stream (27 byte frames, registers
+// 0-24 + dt HI/LO). Repeated frame sequences, as produced by repeated
+// patterns, are written as references to their first occurrence.
+//
+// Records, all numbers little endian:
+//
+//   literal:   u32 change mask (bit 31 clear), then the value of each
+//              changed register in register order (as output mode 7)
+//   reference: u32 0x80000000 | frame count, u32 file offset
+//              replay count literal records starting at file offset
+//
+// A reference only ever points at literal records, and the frame before
+// the referenced run equals the frame before the reference (or the run
+// starts at frame 0, which lists all registers). Replaying the literals'
+// changes on the current registers therefore rebuilds the repeated
+// frames exactly, and a decoder needs no more than a saved read position
+// per reference: it re-reads the referenced records from flash instead of
+// buffering decoded frames.
+class LoopEncoder {
+  public:
+    static const int FRAME_SIZE = 27;
+    static const unsigned int MIN_REFERENCE = 4;  // frames
+    static const uint32_t REFERENCE = 0x80000000u;
+
+    struct Stats
+    {
+      unsigned int frames = 0;
+      unsigned int references = 0;
+      unsigned int referencedframes = 0;
+    };
+
+    // window limits how many frames back a reference may point
+    LoopEncoder(unsigned int window) : window(window) {}
+
+    void encode(const unsigned char *frames, unsigned int count, std::vector<unsigned char> &dest, Stats &stats)
+    {
+      std::vector<uint64_t> framehash(count);
+      std::vector<unsigned int> offset(count);
+      std::vector<bool> literal(count);
+      std::vector<int> chain(count, -1);
+      std::vector<int> head(1 << HASH_BITS, -1);
+
+      for (unsigned int i = 0; i < count; i++)
+        framehash[i] = hashFrame(&frames[i * FRAME_SIZE]);
+
+      stats.frames = count;
+      unsigned int p = 0;
+      while (p < count)
+      {
+        unsigned int bestlen = 0;
+        unsigned int besta = 0;
+
+        // candidates share the hash of frames p and p+1
+        if (p + 1 < count)
+        {
+          int a = head[pairHash(framehash, p)];
+          for (int depth = 0; a >= 0 && depth < MAX_CHAIN; depth++, a = chain[a])
+          {
+            if (p - a > window) break;
+            if (a > 0 && !sameFrame(frames, framehash, a - 1, p - 1)) continue;
+
+            unsigned int len = 0;
+            while (a + len < p && p + len < count && literal[a + len] &&
+                   sameFrame(frames, framehash, a + len, p + len))
+              len++;
+            if (len > bestlen)
+            {
+              bestlen = len;
+              besta = a;
+            }
+          }
+        }
+
+        if (bestlen >= MIN_REFERENCE)
+        {
+          put32(dest, REFERENCE | bestlen);
+          put32(dest, offset[besta]);
+          stats.references++;
+          stats.referencedframes += bestlen;
+          for (unsigned int i = 0; i < bestlen; i++, p++)
+            index(framehash, chain, head, p, count);
+          continue;
+        }
+
+        offset[p] = dest.size();
+        literal[p] = true;
+        const unsigned char *frame = &frames[p * FRAME_SIZE];
+        const unsigned char *prev = p ? frame - FRAME_SIZE : NULL;
+        uint32_t mask = 0;
+        for (int r = 0; r < FRAME_SIZE; r++)
+          if (!prev || frame[r] != prev[r]) mask |= 1u << r;
+        put32(dest, mask);
+        for (int r = 0; r < FRAME_SIZE; r++)
+          if (mask & (1u << r)) dest.push_back(frame[r]);
+        index(framehash, chain, head, p, count);
+        p++;
+      }
+    }
+
+  private:
+    static const int HASH_BITS = 16;
+    static const int MAX_CHAIN = 64;
+
+    static uint64_t hashFrame(const unsigned char *frame)
+    {
+      uint64_t h = 1469598103934665603ull;
+      for (int r = 0; r < FRAME_SIZE; r++)
+        h = (h ^ frame[r]) * 1099511628211ull;
+      return h;
+    }
+
+    static unsigned int pairHash(const std::vector<uint64_t> &framehash, unsigned int p)
+    {
+      uint64_t h = framehash[p] * 31 + framehash[p + 1];
+      return (h ^ (h >> 29)) & ((1 << HASH_BITS) - 1);
+    }
+
+    static bool sameFrame(const unsigned char *frames, const std::vector<uint64_t> &framehash, unsigned int a, unsigned int b)
+    {
+      return framehash[a] == framehash[b] && !memcmp(&frames[a * FRAME_SIZE], &frames[b * FRAME_SIZE], FRAME_SIZE);
+    }
+
+    static void index(const std::vector<uint64_t> &framehash, std::vector<int> &chain, std::vector<int> &head, unsigned int p, unsigned int count)
+    {
+      if (p + 1 >= count)
+        return;
+      unsigned int h = pairHash(framehash, p);
+      chain[p] = head[h];
+      head[h] = p;
+    }
+
+    static void put32(std::vector<unsigned char> &dest, uint32_t v)
+    {
+      dest.push_back(v & 0xff);
+      dest.push_back((v >> 8) & 0xff);
+      dest.push_back((v >> 16) & 0xff);
+      dest.push_back(v >> 24);
+    }
+
+    unsigned int window;
+};
+
+// Decoder for loop encoded streams, usable straight from flash: the state
+// is the current registers plus the read position saved by a reference.
+class LoopDecoder {
+  public:
+    LoopDecoder(const unsigned char *data, size_t size) : data(data), size(size) {}
+
+    // decode the next frame into regs (27 registers incl. dt HI/LO)
+    bool next(unsigned char *regs)
+    {
+      if (!remaining)
+      {
+        if (pos + 4 > size) return false;
+        uint32_t word = get32(pos);
+        if (word & LoopEncoder::REFERENCE)
+        {
+          if (pos + 8 > size) return false;
+          remaining = word & ~LoopEncoder::REFERENCE;
+          resume = pos + 8;
+          pos = get32(pos + 4);
+          if (!remaining) return false;
+        }
+      }
+
+      if (pos + 4 > size) return false;
+      uint32_t mask = get32(pos);
+      if (mask & LoopEncoder::REFERENCE) return false;
+      pos += 4;
+      for (int r = 0; r < LoopEncoder::FRAME_SIZE; r++)
+      {
+        if (!(mask & (1u << r))) continue;
+        if (pos >= size) return false;
+        state[r] = data[pos++];
+      }
+
+      if (remaining && !--remaining)
+        pos = resume;
+      memcpy(regs, state, sizeof(state));
+      return true;
+    }
+
+  private:
+    uint32_t get32(size_t p) const
+    {
+      return data[p] | (data[p + 1] << 8) | (data[p + 2] << 16) | ((uint32_t)data[p + 3] << 24);
+    }
+
+    const unsigned char *data;
+    size_t size;
+    size_t pos = 0;
+    size_t resume = 0;
+    unsigned int remaining = 0;
+    unsigned char state[27] = {0};
+};
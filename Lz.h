@@ -0,0 +1,182 @@
+#pragma once
+#include <string.h>
+#include <vector>
+
+// Small LZ77 codec for the compressed dump container.
+//
+// A block is a sequence of tokens:
+//
+//   T [L...] literals... O O [M...]
+//
+// T = token, high nibble = literal count, low nibble = match length - 4
+// L = extra literal count bytes when the nibble is 15 (255 = keep adding)
+// O = match offset, 16 bit little endian, 1..LZ_WINDOW-1
+// M = extra match length bytes when the nibble is 15
+//
+// The last token of a block has literals only and no offset. Matches
+// never reach back more than LZ_WINDOW bytes, so a decoder only has to
+// keep the last LZ_WINDOW bytes of output, whatever the block size.
+
+#define LZ_WINDOW 4096
+#define LZ_MINMATCH 4
+
+class LzCompressor {
+  public:
+    // compress src into dest, returns the compressed size
+    size_t compress(const unsigned char *src, size_t size, std::vector<unsigned char> &dest)
+    {
+      dest.clear();
+      dest.reserve(size + size / 255 + 16);
+
+      memset(head, 0xff, sizeof(head));
+      if (chain.size() < size) chain.resize(size);
+
+      size_t pos = 0;
+      size_t anchor = 0;
+      while (pos + LZ_MINMATCH <= size)
+      {
+        size_t bestlen = 0;
+        size_t bestoff = 0;
+        unsigned int h = hash(&src[pos]);
+
+        // walk the chain of earlier positions with the same hash
+        int candidate = head[h];
+        for (int depth = 0; candidate >= 0 && depth < MAX_CHAIN; depth++)
+        {
+          size_t off = pos - candidate;
+          if (off >= LZ_WINDOW) break;
+
+          size_t len = 0;
+          while (pos + len < size && src[candidate + len] == src[pos + len]) len++;
+          if (len > bestlen)
+          {
+            bestlen = len;
+            bestoff = off;
+          }
+          candidate = chain[candidate];
+        }
+        chain[pos] = head[h];
+        head[h] = pos;
+
+        if (bestlen < LZ_MINMATCH)
+        {
+          pos++;
+          continue;
+        }
+
+        emit(dest, &src[anchor], pos - anchor, bestoff, bestlen);
+
+        // index the matched bytes so later matches can refer to them
+        size_t end = pos + bestlen;
+        for (pos++; pos < end && pos + LZ_MINMATCH <= size; pos++)
+        {
+          h = hash(&src[pos]);
+          chain[pos] = head[h];
+          head[h] = pos;
+        }
+        pos = end;
+        anchor = pos;
+      }
+      emit(dest, &src[anchor], size - anchor, 0, 0);
+      return dest.size();
+    }
+
+  private:
+    static const int HASH_BITS = 14;
+    static const int MAX_CHAIN = 32;
+
+    static unsigned int hash(const unsigned char *p)
+    {
+      unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+      return (v * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    static void putLength(std::vector<unsigned char> &dest, size_t len)
+    {
+      while (len >= 255)
+      {
+        dest.push_back(255);
+        len -= 255;
+      }
+      dest.push_back(len);
+    }
+
+    // one token: literals, then a match unless matchlen is 0
+    static void emit(std::vector<unsigned char> &dest, const unsigned char *literals, size_t litlen, size_t offset, size_t matchlen)
+    {
+      size_t mcode = matchlen ? matchlen - LZ_MINMATCH : 0;
+      dest.push_back(((litlen < 15 ? litlen : 15) << 4) | (mcode < 15 ? mcode : 15));
+      if (litlen >= 15) putLength(dest, litlen - 15);
+      dest.insert(dest.end(), literals, literals + litlen);
+      if (!matchlen)
+        return;
+      dest.push_back(offset & 0xff);
+      dest.push_back(offset >> 8);
+      if (mcode >= 15) putLength(dest, mcode - 15);
+    }
+
+    int head[1 << HASH_BITS];
+    std::vector<int> chain;
+};
+
+// Streaming decoder. RAM use is the fixed LZ_WINDOW history; decoded bytes
+// are handed to sink(byte) one at a time, the compressed block can be
+// read straight from flash. Returns false on a corrupt block.
+class LzDecoder {
+  public:
+    template <typename Sink>
+    bool decodeBlock(const unsigned char *src, size_t size, Sink &sink)
+    {
+      const unsigned char *end = src + size;
+      pos = 0;
+
+      while (src < end)
+      {
+        unsigned char token = *src++;
+
+        size_t litlen = token >> 4;
+        if (litlen == 15 && !getLength(src, end, litlen)) return false;
+        if ((size_t)(end - src) < litlen) return false;
+        while (litlen--) put(*src++, sink);
+
+        if (src == end)
+          break;
+
+        if (end - src < 2) return false;
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        size_t matchlen = token & 0xf;
+        if (matchlen == 15 && !getLength(src, end, matchlen)) return false;
+        matchlen += LZ_MINMATCH;
+        if (offset == 0 || offset >= LZ_WINDOW || offset > pos) return false;
+
+        while (matchlen--)
+          put(window[(pos - offset) & (LZ_WINDOW - 1)], sink);
+      }
+      return true;
+    }
+
+  private:
+    template <typename Sink>
+    void put(unsigned char c, Sink &sink)
+    {
+      window[pos & (LZ_WINDOW - 1)] = c;
+      pos++;
+      sink(c);
+    }
+
+    static bool getLength(const unsigned char *&src, const unsigned char *end, size_t &len)
+    {
+      unsigned char b;
+      do
+      {
+        if (src == end) return false;
+        b = *src++;
+        len += b;
+      } while (b == 255);
+      return true;
+    }
+
+    unsigned char window[LZ_WINDOW];
+    size_t pos = 0;
+};
@@ -0,0 +1,169 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "cpu.h"
+
+// Counts the reads, writes and executes of every address, separately for
+// init and play. It is attached to the driver as the tracer, so the memory
+// accesses come through MEM() and WRITE() of the observed interpreter; the
+// plain one that runs without it is untouched. Executes count opcode and
+// operand fetches, so every code byte is marked.
+//
+// Binary file, numbers little endian:
+//   "SDHM", u32 version (1), u32 record count
+//   per page with any access, per phase: u8 phase (0 init, 1 play),
+//   u8 page, u32 reads, writes, executes of the page, then 256 u32 reads,
+//   256 u32 writes, 256 u32 executes
+// A file name ending in .json gets the same as JSON instead.
+class MemoryHeatmap : public CpuObserver {
+  public:
+    enum Phase { INIT = 0, PLAY = 1 };
+    enum Kind { READ = 0, WRITE = 1, EXECUTE = 2 };
+
+    MemoryHeatmap() : counts(2 * 3 * 0x10000) {}
+
+    void setPhase(Phase phase) { this->phase = phase; }
+
+    virtual void opcode(unsigned address) { count(EXECUTE, address); }
+    virtual void operand(unsigned address) { count(EXECUTE, address); }
+    virtual void read(unsigned address) { count(READ, address); }
+    virtual void write(unsigned address) { count(WRITE, address); }
+
+    uint32_t at(int phase, Kind kind, unsigned address) const
+    {
+      return counts[(phase * 3 + kind) * 0x10000 + address];
+    }
+
+    // false if the file couldn't be written
+    bool save(const char *filename) const
+    {
+      FILE *out = fopen(filename, "wb");
+      if (!out)
+        return false;
+      size_t length = strlen(filename);
+      if (length >= 5 && !strcmp(&filename[length - 5], ".json"))
+        writeJson(out);
+      else
+        writeBinary(out);
+      return fclose(out) == 0;
+    }
+
+    // per phase the pages touched and the zero page locations used, as
+    // address ranges
+    void printSummary() const
+    {
+      for (int p = INIT; p <= PLAY; p++)
+      {
+        unsigned pages = 0;
+        for (unsigned page = 0; page < 256; page++)
+          pages += used(p, page);
+        printf("Heatmap: %s touched %u pages, zero page", p == INIT ? "init" : "play", pages);
+        unsigned start = 0x100;
+        for (unsigned a = 0; a <= 0x100; a++)
+        {
+          bool hit = a < 0x100 && (at(p, READ, a) || at(p, WRITE, a) || at(p, EXECUTE, a));
+          if (hit && start == 0x100)
+            start = a;
+          if (!hit && start != 0x100)
+          {
+            if (start == a - 1)
+              printf(" $%02X", start);
+            else
+              printf(" $%02X-$%02X", start, a - 1);
+            start = 0x100;
+          }
+        }
+        printf("\n");
+      }
+    }
+
+  private:
+    void count(Kind kind, unsigned address)
+    {
+      counts[(phase * 3 + kind) * 0x10000 + (address & 0xffff)]++;
+    }
+
+    uint64_t pageTotal(int phase, Kind kind, unsigned page) const
+    {
+      uint64_t total = 0;
+      for (unsigned i = 0; i < 256; i++)
+        total += at(phase, kind, (page << 8) + i);
+      return total;
+    }
+
+    bool used(int phase, unsigned page) const
+    {
+      return pageTotal(phase, READ, page) || pageTotal(phase, WRITE, page) || pageTotal(phase, EXECUTE, page);
+    }
+
+    void writeBinary(FILE *out) const
+    {
+      uint32_t records = 0;
+      for (int p = INIT; p <= PLAY; p++)
+        for (unsigned page = 0; page < 256; page++)
+          records += used(p, page);
+
+      std::vector<unsigned char> data;
+      data.insert(data.end(), "SDHM", "SDHM" + 4);
+      put32(data, 1);
+      put32(data, records);
+      for (int p = INIT; p <= PLAY; p++)
+        for (unsigned page = 0; page < 256; page++)
+        {
+          if (!used(p, page))
+            continue;
+          data.push_back(p);
+          data.push_back(page);
+          for (int k = READ; k <= EXECUTE; k++)
+            put32(data, (uint32_t)pageTotal(p, (Kind)k, page));
+          for (int k = READ; k <= EXECUTE; k++)
+            for (unsigned i = 0; i < 256; i++)
+              put32(data, at(p, (Kind)k, (page << 8) + i));
+        }
+      fwrite(data.data(), data.size(), 1, out);
+    }
+
+    // per phase the page summaries, and the addresses with any access as
+    // [address, reads, writes, executes]
+    void writeJson(FILE *out) const
+    {
+      fprintf(out, "{");
+      for (int p = INIT; p <= PLAY; p++)
+      {
+        fprintf(out, "%s\n\"%s\": {\n\"pages\": [", p ? "," : "", p == INIT ? "init" : "play");
+        const char *separator = "";
+        for (unsigned page = 0; page < 256; page++)
+        {
+          if (!used(p, page))
+            continue;
+          fprintf(out, "%s\n  {\"page\": %u, \"reads\": %llu, \"writes\": %llu, \"executes\": %llu}", separator, page,
+            (unsigned long long)pageTotal(p, READ, page), (unsigned long long)pageTotal(p, WRITE, page),
+            (unsigned long long)pageTotal(p, EXECUTE, page));
+          separator = ",";
+        }
+        fprintf(out, "\n],\n\"addresses\": [");
+        separator = "";
+        for (unsigned a = 0; a < 0x10000; a++)
+        {
+          uint32_t r = at(p, READ, a), w = at(p, WRITE, a), x = at(p, EXECUTE, a);
+          if (!r && !w && !x)
+            continue;
+          fprintf(out, "%s\n  [%u, %u, %u, %u]", separator, a, r, w, x);
+          separator = ",";
+        }
+        fprintf(out, "\n]\n}");
+      }
+      fprintf(out, "\n}\n");
+    }
+
+    static void put32(std::vector<unsigned char> &dest, uint32_t v)
+    {
+      for (int i = 0; i < 4; i++)
+        dest.push_back((v >> (i * 8)) & 0xff);
+    }
+
+    std::vector<uint32_t> counts;
+    int phase = INIT;
+};
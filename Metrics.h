@@ -0,0 +1,253 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counters of what runs did, for dashboards to scrape: instructions,
+// emulated cycles, init and play time, frames, bytes per output mode,
+// playroutine aborts and the time spent waiting for output to drain.
+//
+// Every thread adds to counters of its own, which only it writes, so an
+// add is a load and a store without locking or a locked instruction; they
+// are summed when the metrics are saved. Saved as Prometheus text format,
+// or JSON if the file name ends in .json, with the totals since start and
+// the last finished run.
+class Metrics {
+  public:
+    enum Counter
+    {
+      RUNS, INSTRUCTIONS, CYCLES, FRAMES, INIT_TIME, PLAY_TIME, OUTPUT_BLOCKED, RUNAWAYS, HALTS,
+      COUNTERS
+    };
+
+    // output modes, see SidOutputFactory
+    static const int SINKS = 14;
+
+    // what one run (a tune played to its end) did, see finish()
+    struct Run
+    {
+      unsigned long long values[COUNTERS] = {0};
+      unsigned long long bytes[SINKS] = {0};
+
+      void addBytes(int mode, unsigned long long n) { bytes[mode >= 0 && mode < SINKS ? mode : 0] += n; }
+    };
+
+    // never destroyed, saveEvery() may still be writing at exit
+    static Metrics &global()
+    {
+      static Metrics *metrics = new Metrics;
+      return *metrics;
+    }
+
+    // nanoseconds, for the time counters
+    static uint64_t now()
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // add to a counter of the calling thread
+    void add(Counter counter, unsigned long long n) { bump(local().values[counter], n); }
+
+    // add a finished run to the calling thread's counters and keep it as
+    // the last run
+    void finish(const Run &run)
+    {
+      Block &block = local();
+      bump(block.values[RUNS], 1);
+      for (int i = RUNS + 1; i < COUNTERS; i++)
+        bump(block.values[i], run.values[i]);
+      for (int i = 0; i < SINKS; i++)
+        bump(block.bytes[i], run.bytes[i]);
+      std::lock_guard<std::mutex> guard(lock);
+      last = run;
+    }
+
+    // false if the file couldn't be written
+    bool save(const char *filename)
+    {
+      Run total;
+      Run lastrun;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+          for (int i = 0; i < COUNTERS; i++)
+            total.values[i] += blocks[b]->values[i].load(std::memory_order_relaxed);
+          for (int i = 0; i < SINKS; i++)
+            total.bytes[i] += blocks[b]->bytes[i].load(std::memory_order_relaxed);
+        }
+        lastrun = last;
+      }
+
+      // written to a temporary file and renamed, so a scraper never reads
+      // half of it
+      char temporary[300];
+      snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+      FILE *out = fopen(temporary, "w");
+      if (!out)
+        return false;
+      size_t length = strlen(filename);
+      if (length >= 5 && !strcmp(&filename[length - 5], ".json"))
+      {
+        fprintf(out, "{\n");
+        writeJson(out, "total", total);
+        fprintf(out, ",\n");
+        writeJson(out, "last_run", lastrun, true);
+        fprintf(out, "\n}\n");
+      }
+      else
+        writePrometheus(out, total, lastrun);
+      if (fclose(out) != 0)
+        return false;
+      return rename(temporary, filename) == 0;
+    }
+
+    // save to filename every interval seconds from a thread of its own,
+    // for the server and the scheduler, which run for long
+    void saveEvery(const char *filename, unsigned int interval)
+    {
+      std::string name = filename;
+      std::thread([this, name, interval] {
+        for (;;)
+        {
+          std::this_thread::sleep_for(std::chrono::seconds(interval));
+          if (!save(name.c_str()))
+            printf("Error: couldn't write %s\n", name.c_str());
+        }
+      }).detach();
+    }
+
+  private:
+    struct Block
+    {
+      std::atomic<unsigned long long> values[COUNTERS];
+      std::atomic<unsigned long long> bytes[SINKS];
+
+      Block()
+      {
+        for (int i = 0; i < COUNTERS; i++) values[i] = 0;
+        for (int i = 0; i < SINKS; i++) bytes[i] = 0;
+      }
+    };
+
+    // only the owning thread writes, so no read-modify-write is needed
+    static void bump(std::atomic<unsigned long long> &counter, unsigned long long n)
+    {
+      counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // the calling thread's counters, registered the first time. They
+    // outlive the thread, its counts stay in the totals.
+    Block &local()
+    {
+      static thread_local Block *mine = NULL;
+      if (!mine)
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        mine = new Block;
+        blocks.push_back(mine);
+      }
+      return *mine;
+    }
+
+    struct Description
+    {
+      const char *name;
+      const char *type;
+      const char *help;
+      double scale;
+    };
+
+    static const Description &describe(int counter)
+    {
+      static const Description descriptions[COUNTERS] = {
+        {"runs", "counter", "Tunes played to their end", 1},
+        {"instructions", "counter", "6502 instructions executed, init included", 1},
+        {"cycles", "counter", "Emulated CPU cycles in the playroutine", 1},
+        {"frames", "counter", "Frames passed to the output", 1},
+        {"init_seconds", "counter", "Time spent in initroutines", 1e-9},
+        {"play_seconds", "counter", "Time spent playing, output included", 1e-9},
+        {"output_blocked_seconds", "counter", "Time waiting for output to drain", 1e-9},
+        {"runaways", "counter", "Playroutine calls aborted after MAX_INSTR instructions", 1},
+        {"halts", "counter", "Init or playroutine calls that halted the CPU", 1},
+      };
+      return descriptions[counter];
+    }
+
+    // the counters a run has on its own; waits for output are counted on
+    // the thread that waits, which may serve several runs
+    static bool perRun(int counter) { return counter != RUNS && counter != OUTPUT_BLOCKED; }
+
+    // counts as they are, times in seconds
+    static void writeValue(FILE *out, int counter, unsigned long long value)
+    {
+      if (describe(counter).scale == 1)
+        fprintf(out, "%llu", value);
+      else
+        fprintf(out, "%.9f", value * describe(counter).scale);
+    }
+
+    void writePrometheus(FILE *out, const Run &total, const Run &lastrun)
+    {
+      for (int i = 0; i < COUNTERS; i++)
+      {
+        const Description &d = describe(i);
+        fprintf(out, "# HELP siddump_%s_total %s.\n# TYPE siddump_%s_total %s\n", d.name, d.help, d.name, d.type);
+        fprintf(out, "siddump_%s_total ", d.name);
+        writeValue(out, i, total.values[i]);
+        fprintf(out, "\n");
+        if (perRun(i))
+        {
+          fprintf(out, "# HELP siddump_last_run_%s %s, last run.\n# TYPE siddump_last_run_%s gauge\n", d.name,
+            d.help, d.name);
+          fprintf(out, "siddump_last_run_%s ", d.name);
+          writeValue(out, i, lastrun.values[i]);
+          fprintf(out, "\n");
+        }
+      }
+      fprintf(out, "# HELP siddump_output_bytes_total Bytes written, by output mode.\n"
+        "# TYPE siddump_output_bytes_total counter\n");
+      for (int i = 0; i < SINKS; i++)
+        if (total.bytes[i])
+          fprintf(out, "siddump_output_bytes_total{mode=\"%d\"} %llu\n", i, total.bytes[i]);
+      fprintf(out, "# HELP siddump_last_run_output_bytes Bytes written by the last run, by output mode.\n"
+        "# TYPE siddump_last_run_output_bytes gauge\n");
+      for (int i = 0; i < SINKS; i++)
+        if (lastrun.bytes[i])
+          fprintf(out, "siddump_last_run_output_bytes{mode=\"%d\"} %llu\n", i, lastrun.bytes[i]);
+    }
+
+    void writeJson(FILE *out, const char *name, const Run &run, bool lastrun = false)
+    {
+      fprintf(out, "\"%s\": {", name);
+      const char *separator = "";
+      for (int i = 0; i < COUNTERS; i++)
+      {
+        if (lastrun && !perRun(i))
+          continue;
+        fprintf(out, "%s\n  \"%s\": ", separator, describe(i).name);
+        writeValue(out, i, run.values[i]);
+        separator = ",";
+      }
+      fprintf(out, ",\n  \"output_bytes\": {");
+      separator = "";
+      for (int i = 0; i < SINKS; i++)
+        if (run.bytes[i])
+        {
+          fprintf(out, "%s\"%d\": %llu", separator, i, run.bytes[i]);
+          separator = ", ";
+        }
+      fprintf(out, "}\n}");
+    }
+
+    std::mutex lock;
+    std::vector<Block *> blocks;
+    Run last;
+};
@@ -0,0 +1,112 @@
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include "SidState.h"
+
+// Frequency to note lookup for a 96 entry note frequency table.
+//
+// The nearest note of every 16 bit frequency is precomputed, so finding a
+// note is one table read instead of a scan over all 96 entries. The
+// "oldnote sticky" bias of the scan (the old note's distance is divided by
+// the sticky factor once the scan reaches it) only changes the result
+// when the old note lies below the nearest note, then it is kept if the
+// nearest note is not closer than its biased distance. That holds for a
+// strictly increasing table; anything else, e.g. a recalibration with a
+// very low base frequency, falls back to the scan.
+class NoteTable {
+  public:
+    static const int NOTES = 96;
+    static const int NO_NOTE = -1;
+
+    void build(const unsigned int *freqtbllo, const unsigned int *freqtblhi, int oldnotefactor)
+    {
+      factor = oldnotefactor;
+      monotonic = true;
+      for (int d = 0; d < NOTES; d++)
+      {
+        cmpfreq[d] = freqtbllo[d] | (freqtblhi[d] << 8);
+        if (d && cmpfreq[d] <= cmpfreq[d - 1]) monotonic = false;
+      }
+      if (!monotonic)
+        return;
+
+      // walk the frequencies upwards, moving to the next note once it is
+      // strictly closer (ties keep the lower note, as the scan does)
+      int d = 0;
+      for (int freq = 0; freq < 0x10000; freq++)
+      {
+        while (d < NOTES - 1 && abs(freq - cmpfreq[d + 1]) < abs(freq - cmpfreq[d]))
+          d++;
+        nearestnote[freq] = d;
+      }
+    }
+
+    // note for freq, favoring oldnote (NO_NOTE if there is none)
+    int find(unsigned short freq, int oldnote) const
+    {
+      if (!monotonic)
+        return scan(freq, oldnote);
+
+      int note = nearestnote[freq];
+      if (oldnote >= 0 && oldnote < note)
+      {
+        if (abs(freq - cmpfreq[note]) >= abs(freq - cmpfreq[oldnote]) / factor)
+          return oldnote;
+      }
+      return note;
+    }
+
+    // the original linear search, kept as the reference
+    int scan(unsigned short freq, int oldnote) const
+    {
+      int note = 0;
+      int dist = 0x7fffffff;
+      for (int d = 0; d < NOTES; d++)
+      {
+        if (abs(freq - cmpfreq[d]) < dist)
+        {
+          dist = abs(freq - cmpfreq[d]);
+          // Favor the old note
+          if (d == oldnote) dist /= factor;
+          note = d;
+        }
+      }
+      return note;
+    }
+
+    // Batch kernel for analytics: resolve the note of each voice for a
+    // block of consecutive frames, with the key on rule of the listing: a
+    // gate on after a gate off or after a frame without waveform restarts
+    // the sticky note. notes[f][v] is NO_NOTE while a voice has no
+    // waveform selected, the sticky note is kept over such frames.
+    // prevnotes/prevwaves carry the voice state from one block to the next
+    // and should start out as NO_NOTE/0.
+    void resolveBlock(const SidFrame *frames, int count, int (*notes)[3], int *prevnotes, unsigned char *prevwaves) const
+    {
+      for (int f = 0; f < count; f++)
+      {
+        for (int v = 0; v < 3; v++)
+        {
+          unsigned char wave = frames[f].sidreg[4 + 7*v];
+          unsigned short freq = frames[f].sidreg[7*v] | (frames[f].sidreg[1 + 7*v] << 8);
+          int note = NO_NOTE;
+
+          if (wave >= 0x10)
+          {
+            if ((wave & 1) && (!(prevwaves[v] & 1) || prevwaves[v] < 0x10))
+              prevnotes[v] = NO_NOTE;
+            note = find(freq, prevnotes[v]);
+            prevnotes[v] = note;
+          }
+          notes[f][v] = note;
+          prevwaves[v] = wave;
+        }
+      }
+    }
+
+  private:
+    int cmpfreq[NOTES];
+    unsigned char nearestnote[0x10000];
+    int factor = 1;
+    bool monotonic = false;
+};
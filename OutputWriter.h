@@ -0,0 +1,268 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Metrics.h"
+
+// Buffered file writer shared by the file outputs. Bytes are collected in
+// one of two large preallocated buffers; a full buffer is handed to a
+// background thread which pwrite()s it at its file offset while the other
+// buffer keeps filling, so the emulation never waits on the disk unless
+// both buffers are busy.
+class OutputWriter {
+  public:
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    OutputWriter()
+    {
+      buffers[0] = new unsigned char[BUFFER_SIZE];
+      buffers[1] = new unsigned char[BUFFER_SIZE];
+      active = buffers[0];
+    }
+
+    ~OutputWriter()
+    {
+      close();
+      delete[] buffers[0];
+      delete[] buffers[1];
+    }
+
+    // open (and truncate) filename, optionally reserving expected bytes on
+    // disk up front. Returns false if the file can't be created.
+    bool open(const char *filename, unsigned long long expected = 0)
+    {
+      fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+        return false;
+
+      if (expected)
+        preallocated = (posix_fallocate(fd, 0, expected) == 0);
+
+      stopping = false;
+      worker = std::thread(&OutputWriter::writerLoop, this);
+      return true;
+    }
+
+    // write to a socket or pipe that is already open instead of a file.
+    // Data goes out in chunks of a u32 little endian length and that many
+    // bytes, one as soon as limit bytes are buffered, so the reader sees
+    // the output while it is being produced. The descriptor stays open.
+    void attach(int stream, size_t limit = 4096)
+    {
+      fd = stream;
+      chunked = true;
+      this->limit = limit;
+      stopping = false;
+      worker = std::thread(&OutputWriter::writerLoop, this);
+    }
+
+    void put(unsigned char c)
+    {
+      if (fill >= limit) swap();
+      active[fill++] = c;
+    }
+
+    void write(const void *data, size_t size)
+    {
+      const unsigned char *src = (const unsigned char *)data;
+      while (size)
+      {
+        if (fill >= limit) swap();
+        size_t n = limit - fill;
+        if (n > size) n = size;
+        memcpy(&active[fill], src, n);
+        fill += n;
+        src += n;
+        size -= n;
+      }
+    }
+
+    void puts(const char *text) { write(text, strlen(text)); }
+
+    // direct access for formatting in place: returns room for at least
+    // size bytes (size <= BUFFER_SIZE), commit() what was actually used
+    unsigned char *reserve(size_t size)
+    {
+      if (BUFFER_SIZE - fill < size || fill >= limit) swap();
+      return &active[fill];
+    }
+
+    void commit(size_t size) { fill += size; }
+
+    // total bytes written so far, including what is still buffered
+    unsigned long long bytes() const { return offset + fill; }
+
+    bool isOpen() const { return fd >= 0; }
+
+    // overwrite bytes at pos, which must lie before bytes(); used to patch
+    // headers whose contents are only known at the end. On an attached
+    // stream only the part still buffered can be changed.
+    void rewrite(unsigned long long pos, const void *data, size_t size)
+    {
+      const unsigned char *src = (const unsigned char *)data;
+      if (fd >= 0)
+      {
+        // let a buffer in flight land first so it can't overwrite the patch
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return pending == NULL; });
+      }
+
+      // the part that already went to the file, then the buffered rest
+      size_t written = 0;
+      if (pos < offset)
+        written = (offset - pos < size) ? offset - pos : size;
+      if (written && fd >= 0 && !chunked && pwrite(fd, src, written, pos) != (ssize_t)written)
+        printf("Error: couldn't write output file\n");
+      src += written;
+      pos += written;
+      size -= written;
+      if (size)
+        memcpy(&active[pos - offset], src, size);
+    }
+
+    // hand what is buffered to the writer thread and wait until it is
+    // written, the output stays open
+    void flush()
+    {
+      if (fd < 0)
+        return;
+      if (fill) swap();
+      std::unique_lock<std::mutex> guard(lock);
+      cond.wait(guard, [this] { return pending == NULL; });
+    }
+
+    // flush everything, trim a preallocated file to its real size and close
+    void close()
+    {
+      if (fd < 0)
+        return;
+
+      if (fill) swap();
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+      }
+      cond.notify_all();
+      worker.join();
+
+      if (preallocated && ftruncate(fd, offset) != 0)
+        printf("Error: couldn't truncate output file\n");
+      if (!chunked)
+        ::close(fd);
+      fd = -1;
+      chunked = false;
+      limit = BUFFER_SIZE;
+    }
+
+  private:
+    OutputWriter(const OutputWriter &) = delete;
+    OutputWriter &operator=(const OutputWriter &) = delete;
+
+    // queue the active buffer for writing and continue in the other one
+    void swap()
+    {
+      if (fd < 0)
+      {
+        // nothing to write to, drop the data but keep counting
+        offset += fill;
+        fill = 0;
+        return;
+      }
+
+      std::unique_lock<std::mutex> guard(lock);
+      if (pending)
+      {
+        // the writer thread hasn't caught up, the emulation waits
+        uint64_t blocked = Metrics::now();
+        cond.wait(guard, [this] { return pending == NULL; });
+        Metrics::global().add(Metrics::OUTPUT_BLOCKED, Metrics::now() - blocked);
+      }
+      pending = active;
+      pendingSize = fill;
+      pendingOffset = offset;
+      guard.unlock();
+      cond.notify_all();
+
+      offset += fill;
+      fill = 0;
+      active = (active == buffers[0]) ? buffers[1] : buffers[0];
+    }
+
+    void writerLoop()
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      for (;;)
+      {
+        cond.wait(guard, [this] { return pending != NULL || stopping; });
+        if (!pending)
+          break;
+
+        unsigned char *data = pending;
+        size_t size = pendingSize;
+        off_t pos = pendingOffset;
+        guard.unlock();
+
+        if (chunked)
+        {
+          // a reader that went away just doesn't get the rest
+          unsigned char header[4] = {(unsigned char)size, (unsigned char)(size >> 8),
+                                     (unsigned char)(size >> 16), (unsigned char)(size >> 24)};
+          if (sendAll(header, 4))
+            sendAll(data, size);
+          size = 0;
+        }
+        while (size)
+        {
+          ssize_t n = pwrite(fd, data, size, pos);
+          if (n <= 0)
+          {
+            printf("Error: couldn't write output file\n");
+            break;
+          }
+          data += n;
+          size -= n;
+          pos += n;
+        }
+
+        guard.lock();
+        pending = NULL;
+        cond.notify_all();
+      }
+    }
+
+    bool sendAll(const unsigned char *data, size_t size)
+    {
+      while (size)
+      {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+      }
+      return true;
+    }
+
+    int fd = -1;
+    bool preallocated = false;
+    bool chunked = false;
+    size_t limit = BUFFER_SIZE;
+    unsigned char *buffers[2];
+    unsigned char *active;
+    size_t fill = 0;
+    unsigned long long offset = 0;
+
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable cond;
+    unsigned char *pending = NULL;
+    size_t pendingSize = 0;
+    unsigned long long pendingOffset = 0;
+    bool stopping = false;
+};
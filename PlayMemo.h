@@ -0,0 +1,287 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "cpu.h"
+
+// Memoization of the playroutine. A call is recorded through the CPU
+// observer: the memory it read before writing it (code bytes included)
+// with their values, and the locations it wrote. The emulation is
+// deterministic, so whenever those locations hold the same values again
+// the call would do the same, and its writes, cycles and registers can be
+// applied without interpreting it.
+//
+// Calls are kept in a radix trie in read order: a node holds a run of
+// (address, value) reads that must all match, its children the different
+// values seen at the read where recorded calls went separate ways (the
+// address read there is the same for all, as everything before matched).
+// A lookup reads one path, never more locations than the call would. When
+// the table is full it starts over.
+class PlayMemo : public CpuObserver {
+  public:
+    struct Entry
+    {
+      std::vector<std::pair<uint16_t, unsigned char> > writes;
+      unsigned int cycles;
+      unsigned int instructions;
+      unsigned short pc;
+      unsigned char a, x, y, flags, sp;
+    };
+
+    // average reads per stored call before the table starts over
+    static const size_t READS_PER_ENTRY = 2048;
+
+    // with verify, every hit is also interpreted and the results compared
+    PlayMemo(size_t capacity, bool verify) : capacity(capacity ? capacity : 1), verify(verify)
+    {
+      readstamp.resize(0x10000);
+      writestamp.resize(0x10000);
+      if (verify) scratch = new CpuState;
+    }
+
+    ~PlayMemo() { delete scratch; }
+
+    void clear()
+    {
+      nodes.clear();
+      entries.clear();
+      storedreads = 0;
+    }
+
+    // the recorded call matching the machine state, or NULL
+    const Entry *find(const CpuState &state)
+    {
+      frames++;
+      if (state.pc != playaddress || nodes.empty())
+        return NULL;
+
+      const unsigned char *mem = state.mem;
+      int n = 0;
+      for (;;)
+      {
+        // the first read of a node was checked when it was chosen
+        const Node &node = nodes[n];
+        for (size_t i = 1; i < node.reads.size(); i++)
+          if (mem[node.reads[i].first] != node.reads[i].second)
+            return NULL;
+        if (node.entry >= 0)
+        {
+          hits++;
+          return &entries[node.entry];
+        }
+
+        int c = node.child;
+        if (c < 0)
+          return NULL;
+        unsigned char value = mem[nodes[c].reads[0].first];
+        while (c >= 0 && nodes[c].reads[0].second != value) c = nodes[c].sibling;
+        if (c < 0)
+          return NULL;
+        n = c;
+      }
+    }
+
+    // state must be right after initcpu() for the playroutine
+    void apply(const Entry &entry, CpuState &state)
+    {
+      for (size_t i = 0; i < entry.writes.size(); i++)
+        state.mem[entry.writes[i].first] = entry.writes[i].second;
+      state.pc = entry.pc;
+      state.a = entry.a;
+      state.x = entry.x;
+      state.y = entry.y;
+      state.flags = entry.flags;
+      state.sp = entry.sp;
+      state.cpucycles = entry.cycles;
+    }
+
+    bool verifying() const { return verify; }
+
+    // before interpreting a hit in verify mode: keep what the memo predicts
+    void predict(const Entry &entry, const CpuState &state)
+    {
+      *scratch = state;
+      apply(entry, *scratch);
+    }
+
+    // after interpreting it: compare with the prediction
+    void check(const CpuState &state)
+    {
+      if (!memcmp(scratch->mem, state.mem, sizeof(state.mem)) && scratch->cpucycles == state.cpucycles &&
+          scratch->pc == state.pc && scratch->a == state.a && scratch->x == state.x &&
+          scratch->y == state.y && scratch->flags == state.flags && scratch->sp == state.sp)
+        return;
+      if (mismatches++ < 10)
+        printf("Memo: mismatch in frame %u\n", frames - 1);
+    }
+
+    // start recording a call, state right after initcpu()
+    void begin(const CpuState &state)
+    {
+      if (state.pc != playaddress)
+      {
+        clear();
+        playaddress = state.pc;
+      }
+      mem = state.mem;
+      reads.clear();
+      written.clear();
+      if (++generation == 0)
+      {
+        std::fill(readstamp.begin(), readstamp.end(), 0);
+        std::fill(writestamp.begin(), writestamp.end(), 0);
+        generation = 1;
+      }
+      // the Kernal exit test looks at $01 after every instruction
+      read(0x01);
+    }
+
+    // the call completed: store it
+    void end(const CpuState &state, unsigned int instructions)
+    {
+      storedreads += reads.size();
+      if (entries.size() >= capacity || storedreads > capacity * READS_PER_ENTRY)
+      {
+        clear();
+        flushes++;
+        storedreads = reads.size();
+      }
+
+      int n = insertPath();
+      if (n < 0)
+        return;
+
+      Entry entry;
+      for (size_t i = 0; i < written.size(); i++)
+        entry.writes.push_back(std::make_pair(written[i], state.mem[written[i]]));
+      entry.cycles = state.cpucycles;
+      entry.instructions = instructions;
+      entry.pc = state.pc;
+      entry.a = state.a;
+      entry.x = state.x;
+      entry.y = state.y;
+      entry.flags = state.flags;
+      entry.sp = state.sp;
+      nodes[n].entry = entries.size();
+      entries.push_back(entry);
+    }
+
+    void print() const
+    {
+      printf("Memo: %u frames, %u hits (%.1f%%), %u calls stored, %u flushes", frames, hits,
+        frames ? hits * 100.0 / frames : 0.0, (unsigned)entries.size(), flushes);
+      if (verify)
+        printf(", %u mismatches", mismatches);
+      printf("\n");
+    }
+
+    virtual void opcode(unsigned address) { read(address); }
+    virtual void operand(unsigned address) { read(address); }
+
+    virtual void read(unsigned address)
+    {
+      address &= 0xffff;
+      if (readstamp[address] == generation || writestamp[address] == generation)
+        return;
+      readstamp[address] = generation;
+      reads.push_back(Read(address, mem[address]));
+    }
+
+    virtual void write(unsigned address)
+    {
+      address &= 0xffff;
+      if (writestamp[address] == generation)
+        return;
+      writestamp[address] = generation;
+      written.push_back(address);
+    }
+
+  private:
+    typedef std::pair<uint16_t, unsigned char> Read;
+
+    struct Node
+    {
+      std::vector<Read> reads;
+      int child = -1;
+      int sibling = -1;
+      int entry = -1;  // the call ending here, -1 for inner nodes
+    };
+
+    // add the recorded reads as a path, returns its last node or -1 if it
+    // doesn't fit the trie (can only happen if the call wasn't deterministic)
+    int insertPath()
+    {
+      if (nodes.empty())
+        nodes.push_back(Node());  // root, no reads of its own
+
+      int n = 0;
+      size_t pos = 0;
+      for (;;)
+      {
+        // follow the node's reads as far as they agree
+        size_t k = 0;
+        while (k < nodes[n].reads.size() && pos + k < reads.size() && nodes[n].reads[k] == reads[pos + k])
+          k++;
+
+        if (k < nodes[n].reads.size())
+        {
+          if (pos + k == reads.size() || nodes[n].reads[k].first != reads[pos + k].first)
+            return -1;
+          // differs at read k: split the node there
+          Node tail;
+          tail.reads.assign(nodes[n].reads.begin() + k, nodes[n].reads.end());
+          tail.child = nodes[n].child;
+          tail.entry = nodes[n].entry;
+          nodes[n].reads.resize(k);
+          nodes[n].entry = -1;
+          nodes[n].child = nodes.size();
+          nodes.push_back(tail);
+        }
+        pos += k;
+
+        if (pos == reads.size())
+          return (nodes[n].entry < 0 && nodes[n].child < 0) ? n : -1;
+        if (nodes[n].entry >= 0)
+          return -1;
+
+        int c = nodes[n].child;
+        if (c >= 0 && nodes[c].reads[0].first != reads[pos].first)
+          return -1;
+        while (c >= 0 && nodes[c].reads[0].second != reads[pos].second) c = nodes[c].sibling;
+        if (c < 0)
+        {
+          Node leaf;
+          leaf.reads.assign(reads.begin() + pos, reads.end());
+          leaf.sibling = nodes[n].child;
+          nodes[n].child = nodes.size();
+          nodes.push_back(leaf);
+          return nodes[n].child;
+        }
+        n = c;
+      }
+    }
+
+    size_t capacity;
+    bool verify;
+    CpuState *scratch = NULL;
+    unsigned int playaddress = 0x10000;
+
+    std::vector<Node> nodes;
+    std::vector<Entry> entries;
+    size_t storedreads = 0;
+
+    // the call being recorded
+    const unsigned char *mem = NULL;
+    std::vector<Read> reads;
+    std::vector<uint16_t> written;
+    std::vector<uint32_t> readstamp;
+    std::vector<uint32_t> writestamp;
+    uint32_t generation = 0;
+
+    unsigned int frames = 0;
+    unsigned int hits = 0;
+    unsigned int flushes = 0;
+    unsigned int mismatches = 0;
+};
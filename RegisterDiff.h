@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Bit n of the result is set when register n differs between two packed
+// 32 byte register blocks (see SidState::packed). Bytes 27-31 of a block
+// are always 0, so only the 27 register bits can be set.
+static inline uint32_t changedRegisters(const unsigned char *current, const unsigned char *previous)
+{
+#if defined(__AVX2__)
+  __m256i a = _mm256_load_si256((const __m256i *)current);
+  __m256i b = _mm256_load_si256((const __m256i *)previous);
+  return ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+#elif defined(__SSE2__)
+  __m128i alo = _mm_load_si128((const __m128i *)current);
+  __m128i ahi = _mm_load_si128((const __m128i *)(current + 16));
+  __m128i blo = _mm_load_si128((const __m128i *)previous);
+  __m128i bhi = _mm_load_si128((const __m128i *)(previous + 16));
+  uint32_t equal = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(alo, blo)) |
+                   ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ahi, bhi)) << 16);
+  return ~equal;
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < 27; i++)
+    if (current[i] != previous[i]) mask |= 1u << i;
+  return mask;
+#endif
+}
+
+static const uint32_t ALL_REGISTERS = (1u << 27) - 1;
+
+static inline int countRegisters(uint32_t mask)
+{
+  return __builtin_popcount(mask);
+}
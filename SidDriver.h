@@ -0,0 +1,306 @@
+#pragma once
+#include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "cpu.h"
+#include "PlayMemo.h"
+#include "Translation.h"
+#include "InstructionTrace.h"
+
+#define MAX_INSTR 0x100000
+
+// The parts of a PSID/RSID file the emulation needs
+struct SidTune
+{
+  unsigned loadaddress = 0;
+  unsigned initaddress = 0;
+  unsigned playaddress = 0;
+  std::vector<unsigned char> data;
+
+  // parse a SID file image, returns NULL or the reason it can't be used
+  const char *parse(const unsigned char *image, size_t size)
+  {
+    if (size < 16)
+      return "couldn't read SID header.";
+
+    unsigned dataoffset = readword(&image[6]);
+    loadaddress = readword(&image[8]);
+    initaddress = readword(&image[10]);
+    playaddress = readword(&image[12]);
+    if (dataoffset > size)
+      return "couldn't read SID header.";
+
+    size_t loadpos = dataoffset;
+    if (loadaddress == 0)
+    {
+      if (loadpos + 2 > size)
+        return "couldn't read SID header.";
+      loadaddress = image[loadpos] | (image[loadpos + 1] << 8);
+      loadpos += 2;
+    }
+
+    size_t loadsize = size - loadpos;
+    if (loadsize + loadaddress >= 0x10000)
+      return "SID data continues past end of C64 memory.";
+    data.assign(&image[loadpos], &image[size]);
+    return NULL;
+  }
+
+  const char *load(const char *filename)
+  {
+    FILE *in = fopen(filename, "rb");
+    if (!in)
+      return "couldn't open SID file.";
+
+    std::vector<unsigned char> image;
+    unsigned char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0 && image.size() < 0x20000)
+      image.insert(image.end(), buffer, buffer + n);
+    fclose(in);
+    return parse(image.data(), image.size());
+  }
+
+  // identifies the machine state after init with this subtune
+  uint64_t hash(int subtune) const
+  {
+    uint64_t h = 1469598103934665603ull;
+    unsigned header[4] = {loadaddress, initaddress, playaddress, (unsigned)subtune};
+    for (int i = 0; i < 4; i++)
+      h = (h ^ header[i]) * 1099511628211ull;
+    for (size_t i = 0; i < data.size(); i++)
+      h = (h ^ data[i]) * 1099511628211ull;
+    return h;
+  }
+
+  static unsigned readword(const unsigned char *p) { return (p[0] << 8) | p[1]; }
+};
+
+enum PlayResult
+{
+  PLAY_OK = 0,
+  PLAY_RUNAWAY = 1,  // more than MAX_INSTR instructions
+  PLAY_HALTED = 2,   // the CPU hit a JAM or an unknown opcode
+  PLAY_SUSPENDED = 3 // resume() used up its budget within the frame
+};
+
+// Runs a tune on its own emulated machine: init once, then the playroutine
+// once per frame. Warnings go to log, or nowhere if it is NULL.
+class SidDriver {
+  public:
+    SidDriver(FILE *log = stdout) : log(log) {}
+
+    // clear the machine, load the tune and call its initroutine; false if
+    // the CPU halted in init
+    bool init(const SidTune &tune, int subtune)
+    {
+      cpu = &state;
+      memset(&state, 0, sizeof(state));
+      loadMemory(tune, state.mem);
+      playaddress = tune.playaddress;
+      initwarnings = 0;
+
+      unsigned char *mem = state.mem;
+      initcpu(tune.initaddress, subtune, 0, 0);
+      int instr = 0;
+      if (trace)
+      {
+        trace->mark(InstructionTrace::INIT, 0);
+        trace->record(state);
+      }
+      while (tracer ? runcpuobserved(tracer) : runcpu())
+      {
+        // Allow SID model detection (including $d011 wait) to eventually terminate
+        ++mem[0xd012];
+        if (!mem[0xd012] || ((mem[0xd011] & 0x80) && mem[0xd012] >= 0x38))
+        {
+            mem[0xd011] ^= 0x80;
+            mem[0xd012] = 0x00;
+        }
+        instr++;
+        if (instr > MAX_INSTR)
+        {
+          initwarnings |= INIT_RUNAWAY;
+          break;
+        }
+        if (trace)
+          trace->record(state);
+      }
+      instructions += instr;
+      if (state.halted)
+        return false;
+
+      if (playaddress == 0)
+      {
+        initwarnings |= INIT_PLAYVECTOR;
+        if ((mem[0x01] & 0x07) == 0x5)
+          playaddress = mem[0xfffe] | (mem[0xffff] << 8);
+        else
+          playaddress = mem[0x314] | (mem[0x315] << 8);
+      }
+      printWarnings();
+      return true;
+    }
+
+    // memory as it is before init: the tune's data and the default bank
+    static void loadMemory(const SidTune &tune, unsigned char *mem)
+    {
+      memset(mem, 0, 0x10000);
+      memcpy(&mem[tune.loadaddress], tune.data.data(), tune.data.size());
+      mem[0x01] = 0x37;
+    }
+
+    // what init had to say; repeated when init is skipped for a snapshot
+    void printWarnings()
+    {
+      if (initwarnings & INIT_RUNAWAY)
+        warn("Warning: CPU executed a high number of instructions in init, breaking\n");
+      if (initwarnings & INIT_PLAYVECTOR)
+      {
+        warn("Warning: SID has play address 0, reading from interrupt vector instead\n");
+        warn("New play address is $%04X\n", playaddress);
+      }
+    }
+
+    // run the playroutine for one frame, through the memo if there is one
+    PlayResult play()
+    {
+      begin();
+      if (tracer || trace || !memo)
+        return run(tracer);
+
+      const PlayMemo::Entry *hit = memo->find(state);
+      if (hit && !memo->verifying())
+      {
+        memo->apply(*hit, state);
+        instructions += hit->instructions;
+        return PLAY_OK;
+      }
+      if (hit)
+      {
+        memo->predict(*hit, state);
+        PlayResult result = run(NULL);
+        memo->check(state);
+        return result;
+      }
+
+      unsigned long long before = instructions;
+      memo->begin(state);
+      PlayResult result = run(memo);
+      if (result == PLAY_OK)
+        memo->end(state, instructions - before);
+      return result;
+    }
+
+    // interpret the playroutine call started by begin() to its end, showing
+    // all memory accesses to observer if there is one
+    PlayResult run(CpuObserver *observer)
+    {
+      return resume(INT_MAX, observer);
+    }
+
+    // a call can also be interpreted in slices: begin() sets it up, each
+    // resume() runs at most budget instructions of it and returns
+    // PLAY_SUSPENDED while the frame isn't complete
+    void begin()
+    {
+      cpu = &state;
+      initcpu(playaddress, 0, 0, 0);
+      frameinstr = 0;
+      if (trace)
+        trace->mark(InstructionTrace::PLAY, calls);
+      calls++;
+    }
+
+    PlayResult resume(int budget, CpuObserver *observer = NULL)
+    {
+      cpu = &state;
+      while (budget > 0)
+      {
+        // a translated block if there is one, else a single instruction
+        int running = 1;
+        int n = (translated && !observer && !trace) ? translated->run(state, running) : 0;
+        if (!n)
+        {
+          if (trace)
+            trace->record(state);
+          running = observer ? runcpuobserved(observer) : runcpu();
+          n = 1;
+        }
+        if (!running)
+        {
+          frameinstr += n - 1;
+          return endFrame();
+        }
+        frameinstr += n;
+        budget -= n;
+        if (frameinstr > MAX_INSTR)
+        {
+          instructions += frameinstr;
+          return PLAY_RUNAWAY;
+        }
+        // Test for jump into Kernal interrupt handler exit
+        if ((state.mem[0x01] & 0x07) != 0x5 && (state.pc == 0xea31 || state.pc == 0xea81))
+          return endFrame();
+      }
+      return PLAY_SUSPENDED;
+    }
+
+    // the machine right after init, to skip init on a later run
+    struct Snapshot
+    {
+      CpuState state;
+      unsigned playaddress;
+      unsigned initwarnings;
+    };
+
+    void save(Snapshot &snapshot) const
+    {
+      snapshot.state = state;
+      snapshot.playaddress = playaddress;
+      snapshot.initwarnings = initwarnings;
+    }
+
+    void restore(const Snapshot &snapshot)
+    {
+      state = snapshot.state;
+      playaddress = snapshot.playaddress;
+      initwarnings = snapshot.initwarnings;
+    }
+
+    static const unsigned INIT_RUNAWAY = 1;     // init stopped at MAX_INSTR
+    static const unsigned INIT_PLAYVECTOR = 2;  // play address taken from the IRQ vector
+
+    CpuState state;
+    unsigned playaddress = 0;
+    unsigned initwarnings = 0;
+    unsigned long long instructions = 0;  // executed so far, init included
+    PlayMemo *memo = NULL;
+    TranslatedCode *translated = NULL;  // used for play only, init is interpreted
+    CpuObserver *tracer = NULL;  // sees every access of init and play, bypasses the memo
+    InstructionTrace *trace = NULL;  // records every instruction, bypasses the memo and translation
+
+  private:
+    PlayResult endFrame()
+    {
+      instructions += frameinstr;
+      return state.halted ? PLAY_HALTED : PLAY_OK;
+    }
+
+    void warn(const char *format, ...)
+    {
+      if (!log)
+        return;
+      va_list args;
+      va_start(args, format);
+      vfprintf(log, format, args);
+      va_end(args);
+    }
+
+    FILE *log;
+    int frameinstr = 0;
+    unsigned int calls = 0;  // playroutine calls begun
+};
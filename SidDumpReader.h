@@ -0,0 +1,127 @@
+#pragma once
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Read-only memory mapping of a whole dump file.
+class MappedFile {
+  public:
+    ~MappedFile() { close(); }
+
+    bool open(const char *filename)
+    {
+      close();
+      int fd = ::open(filename, O_RDONLY);
+      if (fd < 0)
+        return false;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0)
+      {
+        ::close(fd);
+        return false;
+      }
+      size = st.st_size;
+      if (size)
+      {
+        void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        data = (p == MAP_FAILED) ? NULL : (const unsigned char *)p;
+      }
+      ::close(fd);
+      return data != NULL || size == 0;
+    }
+
+    void close()
+    {
+      if (data) munmap((void *)data, size);
+      data = NULL;
+      size = 0;
+    }
+
+    const unsigned char *data = NULL;
+    size_t size = 0;
+};
+
+static inline unsigned int get32(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// Random access reader for keyframe indexed dumps (output mode 9).
+// seek() looks up the keyframe at or before the frame in the index and
+// decodes at most interval-1 delta frames from there.
+class KeyframeDumpReader {
+  public:
+    bool open(const char *filename)
+    {
+      if (!file.open(filename) || file.size < 16)
+        return false;
+
+      const unsigned char *trailer = file.data + file.size - 16;
+      if (memcmp(&trailer[12], "SDKI", 4))
+        return false;
+      indexoffset = get32(&trailer[0]);
+      framecount = get32(&trailer[4]);
+      interval = get32(&trailer[8]);
+      if (!interval || indexoffset > file.size - 16)
+        return false;
+      keyframecount = (file.size - 16 - indexoffset) / 4;
+      index = file.data + indexoffset;
+      return seek(0);
+    }
+
+    unsigned int frames() const { return framecount; }
+    unsigned int keyframeInterval() const { return interval; }
+
+    // position at frame, the next call to next() returns it
+    bool seek(unsigned int frame)
+    {
+      if (frame > framecount)
+        return false;
+      unsigned int key = frame / interval;
+      if (key >= keyframecount)
+        key = keyframecount ? keyframecount - 1 : 0;
+
+      pos = keyframecount ? get32(&index[key * 4]) : 0;
+      current = key * interval;
+      while (current < frame)
+        if (!next(NULL)) return false;
+      return true;
+    }
+
+    // decode the next frame into regs (27 registers incl. dt HI/LO),
+    // regs may be NULL to skip a frame
+    bool next(unsigned char *regs)
+    {
+      if (current >= framecount || pos >= indexoffset)
+        return false;
+
+      unsigned int count = file.data[pos++];
+      if (pos + count * 2 > indexoffset)
+        return false;
+      for (unsigned int i = 0; i < count; i++, pos += 2)
+      {
+        unsigned int reg = file.data[pos];
+        if (reg < 27) state[reg] = file.data[pos + 1];
+      }
+      if (regs) memcpy(regs, state, sizeof(state));
+      current++;
+      return true;
+    }
+
+    // frame number returned by the next call to next()
+    unsigned int tell() const { return current; }
+
+  private:
+    MappedFile file;
+    const unsigned char *index = NULL;
+    unsigned int indexoffset = 0;
+    unsigned int framecount = 0;
+    unsigned int keyframecount = 0;
+    unsigned int interval = 1;
+    unsigned int pos = 0;
+    unsigned int current = 0;
+    unsigned char state[27] = {0};
+};
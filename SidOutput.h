@@ -1,6 +1,17 @@
 #pragma once
 #include <stdbool.h>
+#include <time.h>
 #include "SidState.h"
+#include "OutputWriter.h"
+#include "TextFormat.h"
+#include "NoteTable.h"
+#include "RegisterDiff.h"
+#include "Lz.h"
+#include "ThreadPool.h"
+#include "LoopEncoder.h"
+#include "ColumnStore.h"
+#include "SidSynth.h"
+#include "SidStream.h"
 
 struct SidOutputOptions
 {
@@ -18,6 +29,16 @@ struct SidOutputOptions
   int oldnotefactor = 1;
   int timeseconds = 0;
   int profiling = 0;
+  int pipelined = 0;
+  int ringsize = 1024;
+  int preallocate = 0;
+  int benchmark = 0;
+  int threads = 0;
+  int keyframes = 250;
+  int samplerate = 44100;
+  int runahead = 50;
+  char streamtarget[256] = "-";
+  int outfd = -1;  // server: send the output to this socket instead
   char songfilename[64] = {0}; 
 };
 
@@ -31,347 +52,888 @@ class SidOutput {
     // pure virtual functions
     virtual void preProcessing() = 0;
     // virtual void processCurrentFrame(SidState current, int frames) = 0;
-    virtual void processCurrentFrame(SidState current) = 0;
+    virtual void processCurrentFrame(const SidState &current) = 0;
     virtual void postProcessing() = 0;
 
-    void setOptions(SidOutputOptions *options) {opts = options;}
+    // the run stops early (runaway or halt): write out every frame handed
+    // over so far, the file complete as far as it goes; only the
+    // destructor follows
+    virtual void flush() {}
+
+    // bytes produced so far, 0 if the output doesn't keep count
+    virtual unsigned long long bytesWritten() { return 0; }
+
+    virtual void setOptions(SidOutputOptions *options) {opts = options;}
 
   protected:
+    // mask of the registers changed since prev (all of them on the first
+    // frame), prev is brought up to date
+    uint32_t registerChanges(const SidState &current, SidState &prev)
+    {
+      uint32_t mask = changedRegisters(current.packed, prev.packed);
+      if (current.time.current_time == 0) mask = ALL_REGISTERS;
+      memcpy(prev.packed, current.packed, sizeof(prev.packed));
+      return mask;
+    }
+
     SidOutputOptions *opts;
 };
 
-class BinaryFileOutputRegisterDumps : public SidOutput {
+// Base class for outputs written to a file next to the sid file, through
+// the shared buffered writer
+class FileOutput : public SidOutput {
   public:
-    // pure virtual functions
-    virtual void preProcessing() 
+    virtual void postProcessing() {
+      out.close();
+    };
+
+    virtual void flush() { out.flush(); }
+
+    virtual unsigned long long bytesWritten() { return out.bytes(); }
+
+  protected:
+    // create <songfilename><extension>, reserving room for the expected
+    // number of frames when preallocation is enabled
+    bool openOutput(const char *extension, int bytesperframe)
     {
+      if (opts->outfd >= 0)
+      {
+        out.attach(opts->outfd);
+        return true;
+      }
+
       char filename[64] = {0};
       strcpy(filename, opts->songfilename);
-      strcat(filename, ".dmp");
-      outbinary = fopen(filename, "wb");
-      if (!outbinary)
+      strcat(filename, extension);
+
+      unsigned long long expected = 0;
+      if (opts->preallocate)
+        expected = (unsigned long long)opts->seconds * 50 * bytesperframe;
+
+      if (!out.open(filename, expected))
       {
           printf("Error: couldn't write binary file");
-          fclose(outbinary);
-          return;
-      }      
-    };
+          return false;
+      }
+      return true;
+    }
 
-    virtual void processCurrentFrame(SidState current) {
-      for(int i=0; i < 25; i++)
-        fputc(current.sidreg[i], outbinary);  
-    };
+    OutputWriter out;
+};
 
-    virtual void postProcessing() {
-      fclose(outbinary);  
+class BinaryFileOutputRegisterDumps : public FileOutput {
+  public:
+    // pure virtual functions
+    virtual void preProcessing() 
+    {
+      openOutput(".dmp", 25);
     };
 
-  private:
-    FILE *outbinary = NULL;
+    virtual void processCurrentFrame(const SidState &current) {
+      unsigned char *dest = out.reserve(25);
+      for(int i=0; i < 25; i++)
+        dest[i] = current.sidreg[i];
+      out.commit(25);
+    };
 };
 
-class BinaryFileOutputRegisterAndDtDumps : public SidOutput {
+class BinaryFileOutputRegisterAndDtDumps : public FileOutput {
   public:
 
     // pure virtual functions
     virtual void preProcessing() 
     {
-      char filename[64] = {0};
-      strcpy(filename, opts->songfilename);
-      strcat(filename, ".dmp");
-      outbinary = fopen(filename, "wb");
-      if (!outbinary)
-      {
-          printf("Error: couldn't write binary file");
-          fclose(outbinary);
-          return;
-      }      
+      openOutput(".dmp", 27);
     };
 
-    virtual void processCurrentFrame(SidState current) {
+    virtual void processCurrentFrame(const SidState &current) {
       // for(int i=0; i < 25; i++)
+      unsigned char *dest = out.reserve(27);
       for(int i=0; i < 27; i++)
-        fputc(current.sidreg[i], outbinary);  
+        dest[i] = current.sidreg[i];
+      out.commit(27);
     };
+};
 
-    virtual void postProcessing() {
-      fclose(outbinary);  
+class BinaryFileOutputRegisterChangesOnly : public FileOutput {
+  public:
+    BinaryFileOutputRegisterChangesOnly() { prev_state.reset(); }
+    // pure virtual functions
+    virtual void preProcessing() 
+    {
+      openOutput(".dmp", 1 + 27 * 2);
+    };
+
+    virtual void processCurrentFrame(const SidState &current) {
+      unsigned char *dest = out.reserve(1 + 27 * 2);
+      uint32_t changes = registerChanges(current, prev_state);
+      int len = 1;
+
+      // write the registers that have changed, preceded by their count
+      for (uint32_t m = changes; m; m &= m - 1)
+      {
+        int c = __builtin_ctz(m);
+        dest[len++] = c;
+        dest[len++] = current.packed[c];
+      }
+      int num_regs_to_update = countRegisters(changes);
+      dest[0] = num_regs_to_update;
+      out.commit(len);
     };
 
   private:
-    FILE *outbinary = NULL;
+    SidState prev_state;    
 };
 
-class BinaryFileOutputRegisterChangesOnly : public SidOutput {
+class BinaryFileOutputRegisterChangeMask : public FileOutput {
   public:
-    BinaryFileOutputRegisterChangesOnly() { prev_state.reset(); }
+    BinaryFileOutputRegisterChangeMask() { prev_state.reset(); }
     // pure virtual functions
     virtual void preProcessing() 
     {
-      char filename[64] = {0};
-      strcpy(filename, opts->songfilename);
-      strcat(filename, ".dmp");
-      outbinary = fopen(filename, "wb");
-      if (!outbinary)
+      openOutput(".dmp", 4 + 27);
+    };
+
+    virtual void processCurrentFrame(const SidState &current) {
+      unsigned char *dest = out.reserve(4 + 27);
+      uint32_t changes = registerChanges(current, prev_state);
+      int len = 4;
+
+      // 32 bit change mask (little endian, bit n = register n), followed
+      // by the values of the changed registers in register order
+      dest[0] = changes & 0xff;
+      dest[1] = (changes >> 8) & 0xff;
+      dest[2] = (changes >> 16) & 0xff;
+      dest[3] = changes >> 24;
+      for (uint32_t m = changes; m; m &= m - 1)
+        dest[len++] = current.packed[__builtin_ctz(m)];
+      out.commit(len);
+    };
+
+  private:
+    SidState prev_state;    
+};
+
+// Compressed container: frames in the mode 4 layout (27 bytes, registers
+// 0-24 + dt HI/LO) grouped into blocks that are LZ compressed
+// independently, on a thread pool, and written in frame order.
+//
+// File header: "SDZ1", u8 version, u8 bytes per frame, u16 LZ window,
+//              u32 frames per block
+// Per block:   u32 frame count, u32 raw size, u32 stored size, data
+//              (stored size == raw size means the block is not compressed)
+// All numbers are little endian.
+class CompressedFileOutputRegisterDumps : public FileOutput {
+  public:
+    static const unsigned int FRAMES_PER_BLOCK = 1024;
+    static const unsigned int FRAME_SIZE = 27;
+
+    virtual void preProcessing() 
+    {
+      if (!openOutput(".sdz", FRAME_SIZE))
+        return;
+      pool = new ThreadPool(opts->threads ? opts->threads : ThreadPool::defaultSize());
+
+      unsigned char header[12] = {'S', 'D', 'Z', '1', 1, FRAME_SIZE};
+      put16(&header[6], LZ_WINDOW);
+      put32(&header[8], FRAMES_PER_BLOCK);
+      out.write(header, sizeof(header));
+    };
+
+    virtual void processCurrentFrame(const SidState &current) {
+      // the file couldn't be created, there is nowhere to write blocks to
+      if (!pool)
+        return;
+      if (!block)
       {
-          printf("Error: couldn't write binary file");
-          fclose(outbinary);
-          return;
-      }      
+        block = new Block;
+        block->raw.reserve(FRAMES_PER_BLOCK * FRAME_SIZE);
+      }
+      block->raw.insert(block->raw.end(), current.packed, current.packed + FRAME_SIZE);
+      if (++block->frames == FRAMES_PER_BLOCK)
+        submitBlock();
     };
 
-    virtual void processCurrentFrame(SidState current) {
-      // for(int i=0; i < 25; i++)
-      // for(int i=0; i < 27; i++)
-      //   fputc(current.sidreg[i], outbinary);
-      
-      // count number of registers to provide updates for
-      int num_regs_to_update = 0;
-      for (int c = 0; c < 27; c++)
+    // the partial block goes out too, the file is complete as it stands
+    virtual void flush() {
+      if (pool)
+      {
+        if (block) submitBlock();
+        writeBlocks(pending.size());
+      }
+      out.flush();
+    };
+
+    virtual void postProcessing() {
+      if (pool)
       {
-        if ((current.sidreg[c] != prev_state.sidreg[c]) || (current.time.current_time == 0))
-          ++num_regs_to_update;
+        if (block) submitBlock();
+        writeBlocks(pending.size());
+        delete pool;
+        pool = NULL;
       }
-      fputc(num_regs_to_update, outbinary);
+      out.close();
+    };
+
+  private:
+    struct Block
+    {
+      std::vector<unsigned char> raw;
+      std::vector<unsigned char> packed;
+      unsigned int frames = 0;
+      bool done = false;
+    };
 
-      // Check registers for changes, print the ones that have changed
-      for (int c = 0; c < 27; c++)
+    static void put16(unsigned char *p, unsigned int v) { p[0] = v & 0xff; p[1] = v >> 8; }
+    static void put32(unsigned char *p, unsigned int v) { put16(p, v & 0xffff); put16(p + 2, v >> 16); }
+
+    // hand the current block to the pool, keep at most two blocks per
+    // worker in flight
+    void submitBlock()
+    {
+      Block *b = block;
+      block = NULL;
+      pending.push_back(b);
+      pool->submit([this, b] {
+        static thread_local LzCompressor compressor;
+        compressor.compress(b->raw.data(), b->raw.size(), b->packed);
+        std::unique_lock<std::mutex> guard(lock);
+        b->done = true;
+        cond.notify_all();
+      });
+
+      if (pending.size() > 2 * pool->size())
+        writeBlocks(pending.size() - 2 * pool->size());
+    }
+
+    // write out the oldest count blocks, waiting for them as needed
+    void writeBlocks(size_t count)
+    {
+      while (count--)
       {
-        if ((current.sidreg[c] != prev_state.sidreg[c]) || (current.time.current_time == 0)) 
+        Block *b = pending.front();
         {
-          fputc(c, outbinary);
-          fputc(current.sidreg[c], outbinary);
-          // sprintf(&output[strlen(output)], "%02X ", c);
-          // sprintf(&output[strlen(output)], "%02X ", current.sidreg[c]);
+          std::unique_lock<std::mutex> guard(lock);
+          cond.wait(guard, [b] { return b->done; });
         }
-        prev_state.sidreg[c] = current.sidreg[c];
-      }       
+        pending.pop_front();
+
+        bool stored = b->packed.size() >= b->raw.size();
+        const std::vector<unsigned char> &data = stored ? b->raw : b->packed;
+        unsigned char header[12];
+        put32(&header[0], b->frames);
+        put32(&header[4], b->raw.size());
+        put32(&header[8], data.size());
+        out.write(header, sizeof(header));
+        out.write(data.data(), data.size());
+        delete b;
+      }
+    }
+
+    ThreadPool *pool = NULL;
+    Block *block = NULL;
+    std::deque<Block *> pending;
+    std::mutex lock;
+    std::condition_variable cond;
+};
+
+// Mode 6 frames with every Nth frame written as a keyframe holding all
+// 27 registers, followed by an index of the keyframe offsets and a fixed
+// size trailer, so a reader can start at any frame (see KeyframeDumpReader).
+// The frame data itself is a valid mode 6 stream.
+//
+// Index:   u32 file offset per keyframe
+// Trailer: u32 index offset, u32 frame count, u32 keyframe interval, "SDKI"
+// All numbers are little endian.
+class BinaryFileOutputKeyframes : public FileOutput {
+  public:
+    BinaryFileOutputKeyframes() { prev_state.reset(); }
+    // pure virtual functions
+    virtual void preProcessing() 
+    {
+      interval = opts->keyframes > 0 ? opts->keyframes : 1;
+      openOutput(".dmp", 1 + 27 * 2);
+    };
+
+    virtual void processCurrentFrame(const SidState &current) {
+      uint32_t changes = registerChanges(current, prev_state);
+      if (frames % interval == 0)
+      {
+        index.push_back(out.bytes());
+        changes = ALL_REGISTERS;
+      }
+      frames++;
+
+      unsigned char *dest = out.reserve(1 + 27 * 2);
+      int len = 1;
+      for (uint32_t m = changes; m; m &= m - 1)
+      {
+        int c = __builtin_ctz(m);
+        dest[len++] = c;
+        dest[len++] = current.packed[c];
+      }
+      dest[0] = countRegisters(changes);
+      out.commit(len);
+    };
+
+    // the frames so far get their index, so the file can be read
+    virtual void flush() {
+      writeIndex();
+      out.flush();
     };
 
     virtual void postProcessing() {
-      fclose(outbinary);  
+      writeIndex();
+      out.close();
     };
 
   private:
-    FILE *outbinary = NULL;
-    SidState prev_state;    
+    void writeIndex()
+    {
+      unsigned int indexoffset = out.bytes();
+      for (size_t i = 0; i < index.size(); i++)
+        put32(index[i]);
+      put32(indexoffset);
+      put32(frames);
+      put32(interval);
+      out.write("SDKI", 4);
+    }
+
+    void put32(unsigned int v)
+    {
+      unsigned char *dest = out.reserve(4);
+      dest[0] = v & 0xff;
+      dest[1] = (v >> 8) & 0xff;
+      dest[2] = (v >> 16) & 0xff;
+      dest[3] = v >> 24;
+      out.commit(4);
+    }
+
+    SidState prev_state;
+    std::vector<unsigned int> index;
+    unsigned int frames = 0;
+    unsigned int interval = 1;
 };
 
-class IncludeFileOutputRegisterDumps : public SidOutput {
+// Loop aware output, see LoopEncoder.h for the format. The frames are
+// collected and encoded in one go when the dump is complete, references
+// reach back at most WINDOW frames.
+class BinaryFileOutputLoopReferences : public FileOutput {
   public:
+    static const unsigned int WINDOW = 15000;
 
-    // pure virtual functions
     virtual void preProcessing() 
     {
-      char filename[64] = {0};
-      strcpy(filename, opts->songfilename);
-      strcat(filename, ".h");
-      txtfile = fopen(filename, "w");
-      if (!txtfile)
+      openOutput(".dmp", 27);
+    };
+
+    virtual void processCurrentFrame(const SidState &current) {
+      frames.insert(frames.end(), current.packed, current.packed + 27);
+    };
+
+    // what was collected is encoded and written like a complete dump
+    virtual void flush() {
+      encodeFrames();
+      out.flush();
+    };
+
+    virtual void postProcessing() {
+      encodeFrames();
+      out.close();
+    };
+
+  private:
+    void encodeFrames()
+    {
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      LoopEncoder encoder(WINDOW);
+      LoopEncoder::Stats stats;
+      std::vector<unsigned char> encoded;
+      encoder.encode(frames.data(), frames.size() / 27, encoded, stats);
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      if (elapsed <= 0) elapsed = 1e-9;
+
+      out.write(encoded.data(), encoded.size());
+
+      printf("Loop encoding: %u frames, %u references covering %u frames\n", stats.frames, stats.references, stats.referencedframes);
+      printf("Loop encoding: %u bytes -> %u bytes, ratio %.2f, %.1f MB/s\n", (unsigned)frames.size(), (unsigned)encoded.size(),
+        encoded.size() ? (double)frames.size() / encoded.size() : 0.0, frames.size() / elapsed / 1e6);
+    }
+
+    std::vector<unsigned char> frames;
+};
+
+// Columnar output, one encoded stream per register plus dt and cycles,
+// see ColumnStore.h for the format
+class ColumnarFileOutput : public FileOutput {
+  public:
+    ColumnarFileOutput()
+    {
+      for (int c = 0; c < 25; c++)
+        columns[c].encoding = COLUMN_RLE8;
+      columns[COLUMN_DT].encoding = COLUMN_RLE16;
+      columns[COLUMN_CYCLES].encoding = COLUMN_DELTA;
+    }
+
+    virtual void preProcessing() 
+    {
+      openOutput(".col", 4);
+    };
+
+    virtual void processCurrentFrame(const SidState &current) {
+      for (int c = 0; c < 25; c++)
+        columns[c].add(current.packed[c]);
+      columns[COLUMN_DT].add((current.sidreg[25] << 8) | current.sidreg[26]);
+      columns[COLUMN_CYCLES].add(current.time.cycles);
+      frames++;
+    };
+
+    // the columns so far are written with their directory
+    virtual void flush() {
+      writeColumns();
+      out.flush();
+    };
+
+    virtual void postProcessing() {
+      writeColumns();
+      out.close();
+    };
+
+  private:
+    void writeColumns()
+    {
+      unsigned char header[12 + COLUMN_COUNT * 12];
+      memcpy(header, "SDC1", 4);
+      put32(&header[4], frames);
+      put32(&header[8], COLUMN_COUNT);
+
+      unsigned int offset = sizeof(header);
+      for (int c = 0; c < COLUMN_COUNT; c++)
       {
-          printf("Error: couldn't write binary file");
-          fclose(txtfile);
-          return;
+        unsigned char *entry = &header[12 + c * 12];
+        unsigned int length = columns[c].finish().size();
+        entry[0] = c;
+        entry[1] = columns[c].encoding;
+        entry[2] = entry[3] = 0;
+        put32(&entry[4], offset);
+        put32(&entry[8], length);
+        offset += length;
+      }
+
+      out.write(header, sizeof(header));
+      for (int c = 0; c < COLUMN_COUNT; c++)
+        out.write(columns[c].finish().data(), columns[c].finish().size());
+
+      printf("Columnar: %u frames, %u bytes (mode 4 layout: %u bytes)\n", frames, offset, frames * 27);
+    }
+
+    static void put32(unsigned char *p, unsigned int v)
+    {
+      p[0] = v & 0xff;
+      p[1] = (v >> 8) & 0xff;
+      p[2] = (v >> 16) & 0xff;
+      p[3] = v >> 24;
+    }
+
+    ColumnEncoder columns[COLUMN_COUNT];
+    unsigned int frames = 0;
+};
+
+// Renders the register stream with the built-in SID model to a mono
+// 16 bit PCM WAV file, each frame lasting its dt from sidreg[25]/[26]
+class WavFileOutput : public FileOutput {
+  public:
+    virtual void preProcessing() 
+    {
+      synth = new SidSynth(opts->samplerate);
+      if (!openOutput(".wav", 2 * opts->samplerate / 50))
+        return;
+      // sizes unknown yet: a streamed copy (server) keeps these
+      unsigned char header[44];
+      buildHeader(header, 0xffffffffu - 36);
+      out.write(header, sizeof(header));
+    };
+
+    virtual void processCurrentFrame(const SidState &current) {
+      synth->setRegisters(current.packed);
+
+      // carry the fraction of a sample over to the next frame
+      unsigned int dt = (current.sidreg[25] << 8) | current.sidreg[26];
+      remainder += (unsigned long long)dt * opts->samplerate;
+      int samples = remainder / 1000000;
+      remainder %= 1000000;
+
+      while (samples > 0)
+      {
+        int n = samples < SidSynth::BLOCK_SIZE ? samples : SidSynth::BLOCK_SIZE;
+        synth->render((int16_t *)out.reserve(n * 2), n);
+        out.commit(n * 2);
+        samples -= n;
+      }
+    };
+
+    // the header gets the sizes of what was rendered so far
+    virtual void flush() {
+      patchHeader();
+      out.flush();
+    };
+
+    virtual void postProcessing() {
+      patchHeader();
+      out.close();
+      delete synth;
+      synth = NULL;
+    };
+
+  private:
+    void patchHeader()
+    {
+      unsigned char header[44];
+      buildHeader(header, out.bytes() - 44);
+      out.rewrite(0, header, sizeof(header));
+    }
+
+    void buildHeader(unsigned char *header, unsigned int datasize)
+    {
+      memcpy(&header[0], "RIFF", 4);
+      put32(&header[4], 36 + datasize);
+      memcpy(&header[8], "WAVEfmt ", 8);
+      put32(&header[16], 16);
+      put16(&header[20], 1);  // PCM
+      put16(&header[22], 1);  // mono
+      put32(&header[24], opts->samplerate);
+      put32(&header[28], opts->samplerate * 2);
+      put16(&header[32], 2);
+      put16(&header[34], 16);
+      memcpy(&header[36], "data", 4);
+      put32(&header[40], datasize);
+    }
+
+    static void put16(unsigned char *p, unsigned int v) { p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; }
+    static void put32(unsigned char *p, unsigned int v) { put16(p, v & 0xffff); put16(p + 2, v >> 16); }
+
+    SidSynth *synth = NULL;
+    unsigned long long remainder = 0;
+};
+
+// Live stream of the changed registers of each frame (mode 6 records),
+// written when the frame is due by wall clock: each frame lasts its dt
+// from sidreg[25]/[26]. The emulation runs ahead on the main thread by up
+// to opts->runahead frames, so only the pacing thread sees any jitter.
+class StreamOutput : public SidOutput {
+  public:
+    StreamOutput() { prev_state.reset(); }
+
+    virtual void setOptions(SidOutputOptions *options) {
+      SidOutput::setOptions(options);
+      opts->pipelined = 1;
+      opts->ringsize = opts->runahead;
+
+      // opened here already, so a stream on stdout moves the text to stderr
+      // before anything is printed
+      if (!target.open(opts->streamtarget))
+      {
+        printf("Error: couldn't open stream target %s\n", opts->streamtarget);
+        failed = true;
       }
-      fprintf(txtfile, "unsigned char %s[] = {\n", "sound_data");
+    }
+
+    virtual void preProcessing() {}
+
+    virtual void processCurrentFrame(const SidState &current) {
+      if (failed)
+        return;
+
+      struct timespec now;
+      if (!started)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &due);
+        started = true;
+      }
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+
+      uint32_t changes = registerChanges(current, prev_state);
+      unsigned char record[1 + 27 * 2];
+      int len = 1;
+      for (uint32_t m = changes; m; m &= m - 1)
+      {
+        int c = __builtin_ctz(m);
+        record[len++] = c;
+        record[len++] = current.packed[c];
+      }
+      record[0] = countRegisters(changes);
+      if (!target.write(record, len))
+      {
+        printf("Error: stream target closed\n");
+        failed = true;
+        return;
+      }
+      written += len;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double latency = elapsedUs(due, now);
+      double jitter = -1;
+      if (frames++)
+        jitter = fabs(elapsedUs(lastemit, now) - lastdt);
+      stats.add(latency, jitter);
+      lastemit = now;
+
+      // the next frame is due dt after this one was
+      lastdt = (current.sidreg[25] << 8) | current.sidreg[26];
+      due.tv_nsec += lastdt * 1000;
+      while (due.tv_nsec >= 1000000000)
+      {
+        due.tv_nsec -= 1000000000;
+        due.tv_sec++;
+      }
+    };
+
+    virtual void postProcessing() {
+      target.close();
+      stats.print();
+    };
+
+    virtual unsigned long long bytesWritten() { return written; }
+
+  private:
+    static double elapsedUs(const struct timespec &from, const struct timespec &to)
+    {
+      return (to.tv_sec - from.tv_sec) * 1e6 + (to.tv_nsec - from.tv_nsec) / 1e3;
+    }
+
+    StreamTarget target;
+    PacingStats stats;
+    SidState prev_state;
+    bool failed = false;
+    bool started = false;
+    struct timespec due;
+    struct timespec lastemit;
+    unsigned int lastdt = 0;
+    unsigned int frames = 0;
+    unsigned long long written = 0;
+};
+
+class IncludeFileOutputRegisterDumps : public FileOutput {
+  public:
+
+    // pure virtual functions
+    virtual void preProcessing() 
+    {
+      if (!openOutput(".h", 25 * 7 + 1))
+        return;
+      out.puts("unsigned char sound_data[] = {\n");
     };
     
-    virtual void processCurrentFrame(SidState current) {
-      
+    virtual void processCurrentFrame(const SidState &current) {
+      static const char hexdigits[] = "0123456789abcdef";
+      unsigned char *dest = out.reserve(25 * 7 + 1);
+      int len = 0;
+
+      // "  0x%02x," per register
       for(int i=0; i < 25; i++)
       {
-        fprintf(txtfile, "  ");
-        fprintf(txtfile, "0x%02x,", current.sidreg[i]);
+        dest[len++] = ' ';
+        dest[len++] = ' ';
+        dest[len++] = '0';
+        dest[len++] = 'x';
+        dest[len++] = hexdigits[(current.sidreg[i] >> 4) & 0xf];
+        dest[len++] = hexdigits[current.sidreg[i] & 0xf];
+        dest[len++] = ',';
       }
 
-      fprintf(txtfile, "\n");          
+      dest[len++] = '\n';
+      out.commit(len);
     };
 
     virtual void postProcessing() {
-      fprintf(txtfile, "};\n");
-      fclose(txtfile);  
+      out.puts("};\n");
+      out.close();
     };
+};
 
-  private:
-    FILE *txtfile = NULL;
+// Base class for outputs printed to the screen, rows are built in a
+// TextLine and written to stdout (or the server's client) in one go
+class ScreenOutput : public SidOutput {
+  public:
+    virtual ~ScreenOutput() { delete remote; }
+
+    virtual void setOptions(SidOutputOptions *options) {
+      SidOutput::setOptions(options);
+      if (opts->outfd >= 0)
+      {
+        remote = new OutputWriter();
+        remote->attach(opts->outfd);
+      }
+    }
+
+    virtual void postProcessing() {
+      if (remote) remote->close();
+    }
+
+    virtual unsigned long long bytesWritten() { return written; }
+
+  protected:
+    void emit()
+    {
+      if (!remote)
+      {
+        written += line.print(stdout);
+        return;
+      }
+      remote->write(line.data(), line.length());
+      written += line.length();
+      line.reset();
+    }
+
+    TextLine line;
+    unsigned long long written = 0;
+    OutputWriter *remote = NULL;
 };
 
-class ScreenOutputRegisterChangesOnly : public SidOutput {
+class ScreenOutputRegisterChangesOnly : public ScreenOutput {
   public:
       ScreenOutputRegisterChangesOnly() { prev_state.reset(); }
       // pure virtual function
       virtual void preProcessing()
       {
-        printf("| Frame | #X | [(reg,val) X pairs]                                |");
-        printf("\n");
-        printf("+-------+----+----------------------------------------------------+");
-        printf("\n");
+        line.lit("| Frame | #X | [(reg,val) X pairs]                                |\n");
+        line.lit("+-------+----+----------------------------------------------------+\n");
+        emit();
       }
 
-      virtual void processCurrentFrame(SidState current)
+      virtual void processCurrentFrame(const SidState &current)
       {
-        static int counter = 0;
-        static int rows = 0;
-
-        char output[512];
-        // int time = current.time.current_frame - opts->firstframe;
-        int time = current.time.current_time;
-        output[0] = 0;      
-
-        sprintf(&output[strlen(output)], "| %5d ", current.time.current_frame);
-        // sprintf(&output[strlen(output)], "|  %04X ", (current.sidreg[25] << 8) | (current.sidreg[26]));
+        line.lit("| ").dec(current.time.current_frame, 5).chr(' ');
 
         // count number of registers to provide updates for
-        int num_regs_to_update = 0;
-        for (int c = 0; c < 27; c++)
-        {
-          if ((current.sidreg[c] != prev_state.sidreg[c]) || (current.time.current_time == 0))
-            ++num_regs_to_update;
-        }
+        uint32_t changes = registerChanges(current, prev_state);
+        int num_regs_to_update = countRegisters(changes);
 
-        sprintf(&output[strlen(output)], "| %02d | ", num_regs_to_update);
+        line.lit("| ").dec(num_regs_to_update, 2, true).lit(" | ");
 
-        // Check registers for changes, print the ones that have changed
-        for (int c = 0; c < 27; c++)
+        // Print the registers that have changed
+        for (uint32_t m = changes; m; m &= m - 1)
         {
-          if ((current.sidreg[c] != prev_state.sidreg[c]) || (current.time.current_time == 0)) 
-          {
-            sprintf(&output[strlen(output)], "%02X ", c);
-            sprintf(&output[strlen(output)], "%02X ", current.sidreg[c]);
-          }
-          prev_state.sidreg[c] = current.sidreg[c];
+          int c = __builtin_ctz(m);
+          line.hex2(c).chr(' ');
+          line.hex2(current.packed[c]).chr(' ');
         } 
 
-        sprintf(&output[strlen(output)], "|\n");
-        printf("%s", output);
+        line.lit("|\n");
+        emit();
       }
 
-    virtual void postProcessing(){}
 
     private:
       SidState prev_state;
 };
 
-class ScreenOutputRegistersOnly : public SidOutput {
+class ScreenOutputRegistersOnly : public ScreenOutput {
   public:
       ScreenOutputRegistersOnly() { prev_state.reset(); }
       // pure virtual function
       virtual void preProcessing()
       {
-        printf("| Frame | 00 01 02 03 04 05 06 | 07 08 09 10 11 12 13 | 14 15 16 17 18 19 20 | 21 22 23 24 | dt_us |");
-        printf("\n");
-        printf("+-------+----------------------+----------------------+----------------------+-------------+-------+");
-        printf("\n");
+        line.lit("| Frame | 00 01 02 03 04 05 06 | 07 08 09 10 11 12 13 | 14 15 16 17 18 19 20 | 21 22 23 24 | dt_us |\n");
+        line.lit("+-------+----------------------+----------------------+----------------------+-------------+-------+\n");
+        emit();
       }
 
-      virtual void processCurrentFrame(SidState current)
+      virtual void processCurrentFrame(const SidState &current)
       {
-        static int counter = 0;
-        static int rows = 0;
-
-        char output[512];
         // int time = current.time.current_frame - opts->firstframe;
         int time = current.time.current_time;
-        output[0] = 0;      
 
         if (!opts->timeseconds)
-          sprintf(&output[strlen(output)], "| %5d | ", current.time.current_frame);
+          line.lit("| ").dec(current.time.current_frame, 5).lit(" | ");
         else
-          // sprintf(&output[strlen(output)], "|%01d:%02d.%02d| ", time/3000, (time/50)%60, time%50);
-          sprintf(&output[strlen(output)], "|%01d:%02d.%02d| ", time/3000, (time/50)%60, time%50);
+          line.chr('|').dec(time/3000, 1).chr(':').dec((time/50)%60, 2, true).chr('.').dec(time%50, 2, true).lit("| ");
 
         // Loop through all registers
+        uint32_t changes = registerChanges(current, prev_state);
         for (int c = 0; c < 25; c++)
         {
-          if ((current.sidreg[c] != prev_state.sidreg[c]) || (current.time.current_time == 0))
-            sprintf(&output[strlen(output)], "%02X ", current.sidreg[c]);
+          if (changes & (1u << c))
+            line.hex2(current.packed[c]).chr(' ');
           else
-            sprintf(&output[strlen(output)], ".. ");
+            line.lit(".. ");
 
           if(c == 6 || c == 13 || c == 20)
-            sprintf(&output[strlen(output)], "| ");
-
-          prev_state.sidreg[c] = current.sidreg[c];
+            line.lit("| ");
         } 
 
-        //sprintf(&output[strlen(output)], "| %04X ", current.cia_val);
-        sprintf(&output[strlen(output)], "|  %04X ", (current.sidreg[25] << 8) | (current.sidreg[26]));
-        sprintf(&output[strlen(output)], "|\n");
-        printf("%s", output);
+        line.lit("|  ").hex4((current.sidreg[25] << 8) | (current.sidreg[26])).chr(' ');
+        line.lit("|\n");
+        emit();
       }
 
-    virtual void postProcessing(){}
 
     private:
       SidState prev_state;
 };
 
-class ScreenOutputWithNotes : public SidOutput {
+class ScreenOutputWithNotes : public ScreenOutput {
   public:
     void setOptions(SidOutputOptions *options) {
-      SidOutput::setOptions(options);
+      ScreenOutput::setOptions(options);
 
       // Recalibrate frequencytable
       if (opts->basefreq)
-      {
         opts->basenote &= 0x7f;
-        if ((opts->basenote < 0) || (opts->basenote > 96))
-        {
-          printf("Warning: Calibration note out of range. Aborting recalibration.\n");
-        }
-        else
-        {
-          for (int c = 0; c < 96; c++)
-          {
-            double note = c - opts->basenote;
-            double freq = (double)opts->basefreq * pow(2.0, note/12.0);
-            int f = freq;
-            if (freq > 0xffff) freq = 0xffff;
-            freqtbllo[c] = f & 0xff;
-            freqtblhi[c] = f >> 8;
-          }
-        }
-      }
+      if (!calibrate(opts, freqlo, freqhi))
+        printf("Warning: Calibration note out of range. Aborting recalibration.\n");
       // Check other parameters for correctness
       if ((opts->lowres) && (!opts->spacing)) opts->lowres = 0;
+
+      notes.build(freqlo, freqhi, opts->oldnotefactor);
+    }
+
+    // the note lookup of the listing, for others that name notes the same way
+    static void buildNoteTable(NoteTable &table, const SidOutputOptions *opts)
+    {
+      unsigned int lo[96], hi[96];
+      calibrate(opts, lo, hi);
+      table.build(lo, hi, opts->oldnotefactor);
     }
 
       // pure virtual function
       virtual void preProcessing()
       {
-        printf("Middle C frequency is $%04X\n\n", freqtbllo[48] | (freqtblhi[48] << 8));
+        line.lit("Middle C frequency is $").hex4(freqlo[48] | (freqhi[48] << 8)).lit("\n\n");
 
-        printf("| Frame | Freq Note/Abs WF ADSR Pul | Freq Note/Abs WF ADSR Pul | Freq Note/Abs WF ADSR Pul | FCut RC Typ V |");
+        line.lit("| Frame | Freq Note/Abs WF ADSR Pul | Freq Note/Abs WF ADSR Pul | Freq Note/Abs WF ADSR Pul | FCut RC Typ V |");
         if (opts->profiling)
 
         { // CPU cycles, Raster lines, Raster lines with badlines on every 8th line, first line included
-          printf(" Cycl RL RB |");
+          line.lit(" Cycl RL RB |");
         }
-        printf("\n");
-        printf("+-------+---------------------------+---------------------------+---------------------------+---------------+");
+        line.chr('\n');
+        line.lit("+-------+---------------------------+---------------------------+---------------------------+---------------+");
         if (opts->profiling)
         {
-          printf("------------+");
+          line.lit("------------+");
         }
-        printf("\n");
+        line.chr('\n');
+        emit();
 
         prev_state.reset();
         prev_state2.reset();
       }
 
-      virtual void processCurrentFrame(SidState current)
+      virtual void processCurrentFrame(const SidState &frame)
       {
-        static int counter = 0;
-        static int rows = 0;
-
-        char output[512];
+        // the notes found are kept in the copy for the next frame
+        SidState current = frame;
         int time = current.time.current_frame - opts->firstframe;
-        output[0] = 0;      
 
         if (!opts->timeseconds)
-          sprintf(&output[strlen(output)], "| %5d | ", time);
+          line.lit("| ").dec(time, 5).lit(" | ");
         else
-          sprintf(&output[strlen(output)], "|%01d:%02d.%02d| ", time/3000, (time/50)%60, time%50);
+          line.chr('|').dec(time/3000, 1).chr(':').dec((time/50)%60, 2, true).chr('.').dec(time%50, 2, true).lit("| ");
 
         // Loop for each channel
         for (int c = 0; c < 3; c++)
@@ -388,28 +950,14 @@ class ScreenOutputWithNotes : public SidOutput {
           // Frequency
           if ((current.time.current_frame == opts->firstframe) || (prev_state.voice[c].note == -1) || (current.voice[c].freq != prev_state.voice[c].freq))
           {
-            int d;
-            int dist = 0x7fffffff;
             int delta = ((int)current.voice[c].freq) - ((int)prev_state2.voice[c].freq);
 
-            sprintf(&output[strlen(output)], "%04X ", current.voice[c].freq);
+            line.hex4(current.voice[c].freq).chr(' ');
 
             if (current.voice[c].wave >= 0x10)
             {
-              // Get new note number
-              for (d = 0; d < 96; d++)
-              {
-                int cmpfreq = freqtbllo[d] | (freqtblhi[d] << 8);
-                int freq = current.voice[c].freq;
-
-                if (abs(freq - cmpfreq) < dist)
-                {
-                  dist = abs(freq - cmpfreq);
-                  // Favor the old note
-                  if (d == prev_state.voice[c].note) dist /= opts->oldnotefactor;
-                    current.voice[c].note = d;
-                }
-              }
+              // Get new note number, favoring the old note
+              current.voice[c].note = notes.find(current.voice[c].freq, prev_state.voice[c].note);
 
               // Print new note
               if (current.voice[c].note != prev_state.voice[c].note)
@@ -417,10 +965,10 @@ class ScreenOutputWithNotes : public SidOutput {
                 if (prev_state.voice[c].note == -1)
                   {
                     if (opts->lowres) newnote = 1;
-                    sprintf(&output[strlen(output)], " %s %02X  ", notename[current.voice[c].note], current.voice[c].note | 0x80);
+                    line.chr(' ').lit(notename[current.voice[c].note]).chr(' ').hex2(current.voice[c].note | 0x80).lit("  ");
                 }
                   else
-                  sprintf(&output[strlen(output)], "(%s %02X) ", notename[current.voice[c].note], current.voice[c].note | 0x80);
+                  line.chr('(').lit(notename[current.voice[c].note]).chr(' ').hex2(current.voice[c].note | 0x80).lit(") ");
               }
               else
               {
@@ -428,112 +976,148 @@ class ScreenOutputWithNotes : public SidOutput {
                 if (delta)
                 {
                   if (delta > 0)
-                      sprintf(&output[strlen(output)], "(+ %04X) ", delta);
+                      line.lit("(+ ").hex4(delta).lit(") ");
                     else
-                      sprintf(&output[strlen(output)], "(- %04X) ", -delta);
+                      line.lit("(- ").hex4(-delta).lit(") ");
                 }
-                else sprintf(&output[strlen(output)], " ... ..  ");
+                else line.lit(" ... ..  ");
               }
             }
-            else sprintf(&output[strlen(output)], " ... ..  ");
+            else line.lit(" ... ..  ");
           }
-          else sprintf(&output[strlen(output)], "....  ... ..  ");
+          else line.lit("....  ... ..  ");
 
           // Waveform
           if ((current.time.current_frame == opts->firstframe) || (newnote) || (current.voice[c].wave != prev_state.voice[c].wave))
-            sprintf(&output[strlen(output)], "%02X ", current.voice[c].wave);
-          else sprintf(&output[strlen(output)], ".. ");
+            line.hex2(current.voice[c].wave).chr(' ');
+          else line.lit(".. ");
 
           // ADSR
-          if ((current.time.current_frame == opts->firstframe) || (newnote) || (current.voice[c].adsr != prev_state.voice[c].adsr)) sprintf(&output[strlen(output)], "%04X ", current.voice[c].adsr);
-          else sprintf(&output[strlen(output)], ".... ");
+          if ((current.time.current_frame == opts->firstframe) || (newnote) || (current.voice[c].adsr != prev_state.voice[c].adsr)) line.hex4(current.voice[c].adsr).chr(' ');
+          else line.lit(".... ");
 
           // Pulse
-          if ((current.time.current_frame == opts->firstframe) || (newnote) || (current.voice[c].pulse != prev_state.voice[c].pulse)) sprintf(&output[strlen(output)], "%03X ", current.voice[c].pulse);
-          else sprintf(&output[strlen(output)], "... ");
+          if ((current.time.current_frame == opts->firstframe) || (newnote) || (current.voice[c].pulse != prev_state.voice[c].pulse)) line.hex(current.voice[c].pulse, 3).chr(' ');
+          else line.lit("... ");
 
-          sprintf(&output[strlen(output)], "| ");
+          line.lit("| ");
         }
 
         // Filter cutoff
-        if ((current.time.current_frame == opts->firstframe) || (current.filt.cutoff != prev_state.filt.cutoff)) sprintf(&output[strlen(output)], "%04X ", current.filt.cutoff);
-        else sprintf(&output[strlen(output)], ".... ");
+        if ((current.time.current_frame == opts->firstframe) || (current.filt.cutoff != prev_state.filt.cutoff)) line.hex4(current.filt.cutoff).chr(' ');
+        else line.lit(".... ");
 
         // Filter control
         if ((current.time.current_frame == opts->firstframe) || (current.filt.ctrl != prev_state.filt.ctrl))
-          sprintf(&output[strlen(output)], "%02X ", current.filt.ctrl);
-        else sprintf(&output[strlen(output)], ".. ");
+          line.hex2(current.filt.ctrl).chr(' ');
+        else line.lit(".. ");
 
         // Filter passband
         if ((current.time.current_frame == opts->firstframe) || ((current.filt.type & 0x70) != (prev_state.filt.type & 0x70)))
-          sprintf(&output[strlen(output)], "%s ", filtername[(current.filt.type >> 4) & 0x7]);
-        else sprintf(&output[strlen(output)], "... ");
+          line.lit(filtername[(current.filt.type >> 4) & 0x7]).chr(' ');
+        else line.lit("... ");
 
         // Mastervolume
-        if ((current.time.current_frame == opts->firstframe) || ((current.filt.type & 0xf) != (prev_state.filt.type & 0xf))) sprintf(&output[strlen(output)], "%01X ", current.filt.type & 0xf);
-        else sprintf(&output[strlen(output)], ". ");
+        if ((current.time.current_frame == opts->firstframe) || ((current.filt.type & 0xf) != (prev_state.filt.type & 0xf))) line.hex(current.filt.type & 0xf, 1).chr(' ');
+        else line.lit(". ");
         
         // Rasterlines / cycle count
         if (opts->profiling)
         {
-          int cycles = cpucycles;
+          int cycles = current.time.cycles;
           int rasterlines = (cycles + 62) / 63;
           int badlines = ((cycles + 503) / 504);
           int rasterlinesbad = (badlines * 40 + cycles + 62) / 63;
-          sprintf(&output[strlen(output)], "| %4d %02X %02X ", cycles, rasterlines, rasterlinesbad);
+          line.lit("| ").dec(cycles, 4).chr(' ').hex2(rasterlines).chr(' ').hex2(rasterlinesbad).chr(' ');
         }
         
         // End of frame display, print info so far and copy SID registers to old registers
-        sprintf(&output[strlen(output)], "|\n");
+        line.lit("|\n");
         if ((!opts->lowres) || (!((current.time.current_frame - opts->firstframe) % opts->spacing)))
         {
-          printf("%s", output);
+          emit();
           for (int c = 0; c < 3; c++)
           {
             prev_state.voice[c] = current.voice[c];
           }
           prev_state.filt = current.filt;
         }
+        else line.reset();
         for (int c = 0; c < 3; c++) prev_state2.voice[c] = current.voice[c];
 
         // Print note/pattern separators
         if (opts->spacing)
         {
           opts->counter++;
-          if (counter >= opts->spacing)
+          if (opts->counter >= opts->spacing)
           {
-            counter = 0;
+            opts->counter = 0;
             if (opts->pattspacing)
             {
-              rows++;
-              if (rows >= opts->pattspacing)
+              opts->rows++;
+              if (opts->rows >= opts->pattspacing)
               {
-                rows = 0;
-                printf("+=======+===========================+===========================+===========================+===============+\n");
+                opts->rows = 0;
+                line.lit("+=======+===========================+===========================+===========================+===============+\n");
+                emit();
               }
               else
-                if (!opts->lowres) printf("+-------+---------------------------+---------------------------+---------------------------+---------------+\n");
+                if (!opts->lowres)
+                {
+                  line.lit("+-------+---------------------------+---------------------------+---------------------------+---------------+\n");
+                  emit();
+                }
             }
             else
-              if (!opts->lowres) printf("+-------+---------------------------+---------------------------+---------------------------+---------------+\n");
+              if (!opts->lowres)
+              {
+                line.lit("+-------+---------------------------+---------------------------+---------------------------+---------------+\n");
+                emit();
+              }
           }
         }
       }
 
-    virtual void postProcessing(){}
 
     private:
       SidState prev_state;
       SidState prev_state2;
+      NoteTable notes;
+      // the frequency table, recalibrated per listing
+      unsigned int freqlo[96];
+      unsigned int freqhi[96];
+
+      // the default table into lo and hi, recalibrated by -c and -d;
+      // false, leaving the default, if the calibration note is out of range
+      static bool calibrate(const SidOutputOptions *opts, unsigned int *lo, unsigned int *hi)
+      {
+        memcpy(lo, freqtbllo, sizeof(freqlo));
+        memcpy(hi, freqtblhi, sizeof(freqhi));
+        if (!opts->basefreq)
+          return true;
+        int basenote = opts->basenote & 0x7f;
+        if ((basenote < 0) || (basenote > 96))
+          return false;
+        for (int c = 0; c < 96; c++)
+        {
+          double note = c - basenote;
+          double freq = (double)opts->basefreq * pow(2.0, note/12.0);
+          int f = freq;
+          if (freq > 0xffff) freq = 0xffff;
+          lo[c] = f & 0xff;
+          hi[c] = f >> 8;
+        }
+        return true;
+      }
 
-      static const char *notename[];
-      static const char *filtername[];
+      static const char notename[][4];
+      static const char filtername[][4];
 
-      static unsigned int freqtbllo[];
-      static unsigned int freqtblhi[];
+      static const unsigned int freqtbllo[];
+      static const unsigned int freqtblhi[];
 };
 
-const char *ScreenOutputWithNotes::notename[] =
+const char ScreenOutputWithNotes::notename[][4] =
 {"C-0", "C#0", "D-0", "D#0", "E-0", "F-0", "F#0", "G-0", "G#0", "A-0", "A#0", "B-0",
   "C-1", "C#1", "D-1", "D#1", "E-1", "F-1", "F#1", "G-1", "G#1", "A-1", "A#1", "B-1",
   "C-2", "C#2", "D-2", "D#2", "E-2", "F-2", "F#2", "G-2", "G#2", "A-2", "A#2", "B-2",
@@ -543,10 +1127,10 @@ const char *ScreenOutputWithNotes::notename[] =
   "C-6", "C#6", "D-6", "D#6", "E-6", "F-6", "F#6", "G-6", "G#6", "A-6", "A#6", "B-6",
   "C-7", "C#7", "D-7", "D#7", "E-7", "F-7", "F#7", "G-7", "G#7", "A-7", "A#7", "B-7"};
 
-const char *ScreenOutputWithNotes::filtername[] =
+const char ScreenOutputWithNotes::filtername[][4] =
 {"Off", "Low", "Bnd", "L+B", "Hi ", "L+H", "B+H", "LBH"};
 
-unsigned int ScreenOutputWithNotes::freqtbllo[] = {
+const unsigned int ScreenOutputWithNotes::freqtbllo[] = {
   0x17,0x27,0x39,0x4b,0x5f,0x74,0x8a,0xa1,0xba,0xd4,0xf0,0x0e,
   0x2d,0x4e,0x71,0x96,0xbe,0xe8,0x14,0x43,0x74,0xa9,0xe1,0x1c,
   0x5a,0x9c,0xe2,0x2d,0x7c,0xcf,0x28,0x85,0xe8,0x52,0xc1,0x37,
@@ -556,7 +1140,7 @@ unsigned int ScreenOutputWithNotes::freqtbllo[] = {
   0xa1,0xc5,0x28,0xcd,0xba,0xf1,0x78,0x53,0x87,0x1a,0x10,0x71,
   0x42,0x89,0x4f,0x9b,0x74,0xe2,0xf0,0xa6,0x0e,0x33,0x20,0xff};
 
-unsigned int ScreenOutputWithNotes::freqtblhi[] = {
+const unsigned int ScreenOutputWithNotes::freqtblhi[] = {
   0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x02,
   0x02,0x02,0x02,0x02,0x02,0x02,0x03,0x03,0x03,0x03,0x03,0x04,
   0x04,0x04,0x04,0x05,0x05,0x05,0x06,0x06,0x06,0x07,0x07,0x08,
@@ -583,6 +1167,20 @@ class SidOutputFactory {
           return new ScreenOutputRegisterChangesOnly();
         case 6:
           return new BinaryFileOutputRegisterChangesOnly();
+        case 7:
+          return new BinaryFileOutputRegisterChangeMask();
+        case 8:
+          return new CompressedFileOutputRegisterDumps();
+        case 9:
+          return new BinaryFileOutputKeyframes();
+        case 10:
+          return new BinaryFileOutputLoopReferences();
+        case 11:
+          return new ColumnarFileOutput();
+        case 12:
+          return new WavFileOutput();
+        case 13:
+          return new StreamOutput();
         default:
           return new ScreenOutputWithNotes();
       }
@@ -0,0 +1,154 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include "SidState.h"
+#include "SidOutput.h"
+#include "Timeline.h"
+#include "Metrics.h"
+
+// Lock-free single producer/single consumer ring of frame records.
+// The capacity is rounded up to a power of two. Both sides spin briefly
+// and then yield while the ring is full/empty, nothing is ever allocated
+// after construction.
+template <typename T>
+class SpscRing {
+  public:
+    SpscRing(unsigned int capacity)
+    {
+      size = 2;
+      while (size < capacity) size <<= 1;
+      mask = size - 1;
+      slots = new T[size];
+    }
+
+    ~SpscRing() { delete[] slots; }
+
+    // producer side, blocks while the ring is full
+    void push(const T &item)
+    {
+      unsigned int h = head.load(std::memory_order_relaxed);
+      unsigned int spins = 0;
+      uint64_t blocked = 0;
+      while (h - tailCache == size)
+      {
+        tailCache = tail.load(std::memory_order_acquire);
+        if (h - tailCache == size)
+        {
+          if (!blocked) blocked = Metrics::now();
+          backoff(spins);
+        }
+      }
+      if (blocked)
+        Metrics::global().add(Metrics::OUTPUT_BLOCKED, Metrics::now() - blocked);
+      slots[h & mask] = item;
+      head.store(h + 1, std::memory_order_release);
+    }
+
+    // consumer side, blocks while the ring is empty
+    void pop(T &item)
+    {
+      unsigned int t = tail.load(std::memory_order_relaxed);
+      unsigned int spins = 0;
+      while (t == headCache)
+      {
+        headCache = head.load(std::memory_order_acquire);
+        if (t == headCache) backoff(spins);
+      }
+      item = slots[t & mask];
+      tail.store(t + 1, std::memory_order_release);
+    }
+
+  private:
+    static void backoff(unsigned int &spins)
+    {
+      if (++spins > 64)
+        std::this_thread::yield();
+    }
+
+    T *slots;
+    unsigned int size;
+    unsigned int mask;
+
+    // producer and consumer indices live on separate cache lines, each
+    // next to the cached copy of the other side's index
+    alignas(64) std::atomic<unsigned int> head{0};
+    unsigned int tailCache = 0;
+    alignas(64) std::atomic<unsigned int> tail{0};
+    unsigned int headCache = 0;
+};
+
+// Runs another output on a separate sink thread. The emulation thread only
+// packs each frame into a SidFrame record and queues it, the sink thread
+// rebuilds the SidState and calls the wrapped output in frame order.
+class PipelinedOutput : public SidOutput {
+  public:
+    PipelinedOutput(SidOutput *sink, unsigned int ringsize) : ring(ringsize)
+    {
+      inner = sink;
+    }
+
+    virtual ~PipelinedOutput() { delete inner; }
+
+    virtual void preProcessing()
+    {
+      inner->preProcessing();
+      worker = std::thread(&PipelinedOutput::sinkLoop, this);
+    }
+
+    virtual void processCurrentFrame(const SidState &current)
+    {
+      SidFrame frame;
+      current.save(frame);
+      ring.push(frame);
+      ++queued;
+    }
+
+    virtual void flush()
+    {
+      while (written.load(std::memory_order_acquire) != queued)
+        std::this_thread::yield();
+      // the sink thread waits on the ring now, so inner is ours to call
+      inner->flush();
+      fflush(stdout);
+    }
+
+    virtual unsigned long long bytesWritten() { return inner->bytesWritten(); }
+
+    virtual void postProcessing()
+    {
+      SidFrame frame;
+      memset(&frame, 0, sizeof(frame));
+      frame.time.current_frame = END_OF_STREAM;
+      ring.push(frame);
+      worker.join();
+      inner->postProcessing();
+    }
+
+  private:
+    static const unsigned int END_OF_STREAM = 0xffffffff;
+
+    void sinkLoop()
+    {
+      SidFrame frame;
+      SidState current;
+      if (Timeline::active())
+        Timeline::active()->nameThread("sink");
+
+      for (;;)
+      {
+        ring.pop(frame);
+        if (frame.time.current_frame == END_OF_STREAM)
+          break;
+        current.load(frame);
+        TimelineSpan span(Timeline::SINK, frame.time.current_frame);
+        inner->processCurrentFrame(current);
+        written.store(written.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+    }
+
+    SidOutput *inner;
+    SpscRing<SidFrame> ring;
+    std::thread worker;
+    unsigned int queued = 0;
+    std::atomic<unsigned int> written{0};
+};
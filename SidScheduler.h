@@ -0,0 +1,240 @@
+#pragma once
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "SidDriver.h"
+#include "SidOutput.h"
+#include "SidState.h"
+#include "Timeline.h"
+#include "Metrics.h"
+
+// One tune playing in real time under the SidScheduler: its own machine,
+// SID state and optional output, and the time its next frame is due.
+struct ScheduledTune
+{
+  typedef std::chrono::steady_clock Clock;
+
+  ScheduledTune(const char *name) : driver(NULL), name(name) {}
+
+  SidDriver driver;
+  SidState sid;
+  SidOutput *output = NULL;  // frames are only emulated when NULL
+  const char *name;
+
+  Clock::time_point start;
+  Clock::time_point due;
+  bool inframe = false;      // a playroutine call is suspended halfway
+  bool failed = false;
+
+  // how late each frame was picked up, in microseconds
+  std::vector<float> latencies;
+  unsigned int slices = 0;
+
+  Metrics::Run run;
+};
+
+// Plays many tunes at once on a few threads. Each tune is a state machine
+// rather than a thread: a worker takes the one whose frame is due first,
+// interprets at most a slice of its playroutine call and puts it back,
+// either suspended mid-frame with the same due time or with the due time
+// of its next frame. A heavy playroutine so can't hold a worker for a
+// whole frame while other tunes are due.
+class SidScheduler {
+  public:
+    typedef ScheduledTune::Clock Clock;
+
+    // instructions interpreted before a tune has to give way
+    static const int SLICE = 1000;
+
+    SidScheduler(unsigned int threads, int slice = SLICE) : threads(threads ? threads : 1), slice(slice) {}
+
+    // tune must be right after init, with sid reset and its end time set
+    void add(ScheduledTune *tune) { tunes.push_back(tune); }
+
+    // play all tunes to their end time, starting them spread over the
+    // first frame so they don't all fall due at once
+    void run()
+    {
+      Clock::time_point start = Clock::now();
+      for (size_t i = 0; i < tunes.size(); i++)
+      {
+        tunes[i]->start = start + std::chrono::microseconds(FRAME_SPREAD * i / tunes.size());
+        tunes[i]->due = tunes[i]->start;
+        if (tunes[i]->output)
+          tunes[i]->output->preProcessing();
+        queue.push(tunes[i]);
+      }
+      active = tunes.size();
+
+      std::vector<std::thread> workers;
+      for (unsigned int i = 0; i < threads; i++)
+        workers.push_back(std::thread(&SidScheduler::workerLoop, this, i));
+      for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+      elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+      for (size_t i = 0; i < tunes.size(); i++)
+        if (tunes[i]->output)
+          tunes[i]->output->postProcessing();
+    }
+
+    void print()
+    {
+      std::vector<float> all;
+      unsigned long long slices = 0;
+      unsigned int failed = 0;
+      for (size_t i = 0; i < tunes.size(); i++)
+      {
+        all.insert(all.end(), tunes[i]->latencies.begin(), tunes[i]->latencies.end());
+        slices += tunes[i]->slices;
+        failed += tunes[i]->failed;
+      }
+      printf("Scheduler: %u tunes on %u threads, %u frames in %.1f s, %llu slices, %u stopped on errors\n",
+        (unsigned)tunes.size(), threads, (unsigned)all.size(), elapsed, slices, failed);
+      if (all.empty())
+        return;
+      std::sort(all.begin(), all.end());
+      printf("Scheduler: latency us p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+        percentile(all, 50), percentile(all, 90), percentile(all, 99), all.back());
+
+      // the tunes that fared worst, by their own p99
+      std::vector<std::pair<float, size_t> > worst;
+      for (size_t i = 0; i < tunes.size(); i++)
+      {
+        std::vector<float> &values = tunes[i]->latencies;
+        if (values.empty())
+          continue;
+        std::sort(values.begin(), values.end());
+        worst.push_back(std::make_pair(percentile(values, 99), i));
+      }
+      std::sort(worst.rbegin(), worst.rend());
+      for (size_t i = 0; i < worst.size() && i < 5; i++)
+      {
+        const ScheduledTune &tune = *tunes[worst[i].second];
+        printf("Scheduler: tune %u (%s) p50 %.1f p99 %.1f max %.1f\n", (unsigned)worst[i].second, tune.name,
+          percentile(tune.latencies, 50), worst[i].first, tune.latencies.back());
+      }
+    }
+
+  private:
+    // microseconds over which the first frames are spread, one PAL frame
+    static const long long FRAME_SPREAD = 20000;
+
+    struct LaterDue
+    {
+      bool operator()(const ScheduledTune *a, const ScheduledTune *b) const { return a->due > b->due; }
+    };
+
+    void workerLoop(unsigned int index)
+    {
+      if (Timeline::active())
+      {
+        char name[32];
+        snprintf(name, sizeof(name), "worker %u", index);
+        Timeline::active()->nameThread(name);
+      }
+      std::unique_lock<std::mutex> guard(lock);
+      while (active)
+      {
+        if (queue.empty())
+        {
+          cond.wait(guard);
+          continue;
+        }
+        ScheduledTune *tune = queue.top();
+        Clock::time_point now = Clock::now();
+        if (tune->due > now)
+        {
+          cond.wait_until(guard, tune->due);
+          continue;
+        }
+        queue.pop();
+        guard.unlock();
+        bool playing = step(*tune, now);
+        guard.lock();
+        if (playing)
+        {
+          queue.push(tune);
+          cond.notify_one();
+        }
+        else if (!--active)
+          cond.notify_all();
+      }
+    }
+
+    // one slice of a tune, false once it has finished
+    bool step(ScheduledTune &tune, Clock::time_point now)
+    {
+      if (!tune.inframe)
+      {
+        tune.latencies.push_back(std::chrono::duration<float, std::micro>(now - tune.due).count());
+        tune.driver.begin();
+        tune.inframe = true;
+      }
+      tune.slices++;
+      SidState &sid = tune.sid;
+      PlayResult result;
+      {
+        TimelineSpan span(Timeline::PLAY, sid.time.current_frame);
+        result = tune.driver.resume(slice);
+      }
+      if (result == PLAY_SUSPENDED)
+        return true;
+      tune.inframe = false;
+      Metrics::Run &run = tune.run;
+      run.values[Metrics::CYCLES] += tune.driver.state.cpucycles;
+      if (result != PLAY_OK)
+      {
+        tune.failed = true;
+        run.values[result == PLAY_HALTED ? Metrics::HALTS : Metrics::RUNAWAYS] = 1;
+        finish(tune);
+        return false;
+      }
+
+      {
+        TimelineSpan span(Timeline::UPDATE, sid.time.current_frame);
+        sid.update(tune.driver.state.mem);
+      }
+      sid.time.cycles = tune.driver.state.cpucycles;
+      if (tune.output)
+      {
+        TimelineSpan span(Timeline::SINK, sid.time.current_frame);
+        tune.output->processCurrentFrame(sid);
+        run.values[Metrics::FRAMES]++;
+      }
+      sid.tick();
+      tune.due = tune.start + std::chrono::microseconds(sid.time.current_time);
+      if (!sid.isPlaying)
+        finish(tune);
+      return sid.isPlaying;
+    }
+
+    // play time is from the tune's start, waits for its frames included
+    void finish(ScheduledTune &tune)
+    {
+      Metrics::Run &run = tune.run;
+      run.values[Metrics::PLAY_TIME] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - tune.start).count();
+      run.values[Metrics::INSTRUCTIONS] = tune.driver.instructions;
+      Metrics::global().finish(run);
+    }
+
+    static float percentile(const std::vector<float> &values, int p)
+    {
+      return values[(values.size() - 1) * p / 100];
+    }
+
+    unsigned int threads;
+    int slice;
+    std::vector<ScheduledTune *> tunes;
+    std::priority_queue<ScheduledTune *, std::vector<ScheduledTune *>, LaterDue> queue;
+    std::mutex lock;
+    std::condition_variable cond;
+    size_t active = 0;
+    double elapsed = 0;
+};
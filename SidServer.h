@@ -0,0 +1,418 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "SidDriver.h"
+#include "SidOutput.h"
+#include "SnapshotCache.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+
+// Dump server: one job per connection on a Unix domain stream socket, run
+// on a fixed pool of workers that each keep their own emulated machine.
+//
+// Request, one line of space separated key=value pairs:
+//   mode=<n> subtune=<n> seconds=<n> path=<sid file>
+//   mode=<n> subtune=<n> seconds=<n> size=<bytes>, followed by the SID file
+// Also accepted: firstframe, spacing, pattspacing, oldnote, lowres,
+// timeseconds, profiling, keyframes, samplerate (as the command line
+// options), maxinstr=<n> (instruction budget) and maxcpu=<ms> (CPU time
+// budget). Modes 0-12; file outputs are sent instead of written. The
+// machine after init is kept in memory for recently used tunes, and on
+// disk as well when a snapshot cache is set.
+//
+// Response: the output in chunks of a u32 little endian length and that
+// many bytes while the frames are produced, then an empty chunk and a
+// status line:
+//   OK frames=<n> instructions=<n> cpu=<ms> cached=<0|1>
+//   ERROR <reason>
+
+// Machines right after init, by tune and subtune. The least recently used
+// entry is dropped when the cache is full.
+class InitCache {
+  public:
+    typedef std::shared_ptr<const SidDriver::Snapshot> Entry;
+
+    InitCache(size_t capacity) : capacity(capacity) {}
+
+    Entry find(uint64_t key)
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      auto it = entries.find(key);
+      if (it == entries.end())
+        return Entry();
+      order.splice(order.begin(), order, it->second.second);
+      return it->second.first;
+    }
+
+    void insert(uint64_t key, Entry entry)
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      if (entries.count(key))
+        return;
+      order.push_front(key);
+      entries[key] = std::make_pair(entry, order.begin());
+      if (entries.size() > capacity)
+      {
+        entries.erase(order.back());
+        order.pop_back();
+      }
+    }
+
+  private:
+    size_t capacity;
+    std::mutex lock;
+    std::list<uint64_t> order;
+    std::unordered_map<uint64_t, std::pair<Entry, std::list<uint64_t>::iterator> > entries;
+};
+
+class SidServer {
+  public:
+    static const size_t MAX_REQUEST = 1024;
+    static const size_t MAX_SIDSIZE = 0x20000;
+    static const size_t CACHE_SIZE = 64;
+    // seconds a client has to send its whole request, and that a send to
+    // it may block, before the connection is dropped
+    static const unsigned int REQUEST_TIMEOUT = 10;
+    static const unsigned int SEND_TIMEOUT = 30;
+
+    // defaults for every job, as given on the command line
+    SidServer(const SidOutputOptions &defaults, unsigned int workers)
+      : defaults(defaults), pool(workers), cache(CACHE_SIZE) {}
+
+    // also keep init snapshots on disk, for tunes not in memory
+    void setSnapshotCache(SnapshotCache *snapshots) { this->snapshots = snapshots; }
+
+    // serve requests on path until the listening socket fails
+    int run(const char *path)
+    {
+      signal(SIGPIPE, SIG_IGN);
+
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+      unlink(path);
+
+      int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0)
+      {
+        printf("Error: couldn't listen on %s\n", path);
+        return 1;
+      }
+      printf("Server: listening on %s with %u workers\n", path, pool.size());
+      fflush(stdout);
+
+      for (;;)
+      {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED) continue;
+          break;
+        }
+        pool.submit([this, client] { serve(client); });
+      }
+      close(listener);
+      return 1;
+    }
+
+  private:
+    struct Request
+    {
+      SidOutputOptions options;
+      int mode = 0;
+      int subtune = 0;
+      unsigned long long maxinstr = 0;
+      unsigned int maxcpu = 0;
+      char path[256] = {0};
+      size_t size = 0;
+    };
+
+    void serve(int fd)
+    {
+      // each worker keeps its machine for all the jobs it runs
+      static thread_local SidDriver *driver = new SidDriver(NULL);
+
+      // a client that stops reading doesn't keep the worker either
+      struct timeval timeout = {SEND_TIMEOUT, 0};
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+      char status[256];
+      runJob(fd, *driver, status, sizeof(status));
+
+      unsigned char end[4] = {0, 0, 0, 0};
+      sendAll(fd, end, sizeof(end));
+      sendAll(fd, status, strlen(status));
+      close(fd);
+    }
+
+    void runJob(int fd, SidDriver &driver, char *status, size_t statussize)
+    {
+      struct timespec cpustart;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpustart);
+
+      Request request;
+      request.options = defaults;
+      std::vector<unsigned char> payload;
+      const char *error = readRequest(fd, request, payload);
+      if (error)
+      {
+        snprintf(status, statussize, "ERROR %s\n", error);
+        return;
+      }
+
+      SidTune tune;
+      error = request.path[0] ? tune.load(request.path) : tune.parse(payload.data(), payload.size());
+      if (error)
+      {
+        snprintf(status, statussize, "ERROR %s\n", error);
+        return;
+      }
+
+      // init, or the machine a previous job left after init
+      driver.instructions = 0;
+      uint64_t initstart = Metrics::now();
+      uint64_t key = tune.hash(request.subtune);
+      InitCache::Entry snapshot = cache.find(key);
+      bool cached = true;
+      if (snapshot)
+        driver.restore(*snapshot);
+      else
+      {
+        if (!snapshots || !snapshots->load(tune, request.subtune, driver))
+        {
+          cached = false;
+          if (!driver.init(tune, request.subtune))
+          {
+            Metrics::global().add(Metrics::HALTS, 1);
+            snprintf(status, statussize, "ERROR CPU halted in initroutine\n");
+            return;
+          }
+          if (snapshots)
+            snapshots->save(tune, request.subtune, driver);
+        }
+        SidDriver::Snapshot *saved = new SidDriver::Snapshot;
+        driver.save(*saved);
+        cache.insert(key, InitCache::Entry(saved));
+      }
+
+      SidOutputOptions &opts = request.options;
+      opts.outfd = fd;
+      opts.pipelined = 0;
+      strcpy(opts.songfilename, "server");
+      SidOutput *output = factory.create(request.mode);
+      output->setOptions(&opts);
+
+      SidState sid;
+      sid.reset();
+      sid.time.end_time = opts.seconds * 1000000;
+      Metrics::Run run;
+      run.values[Metrics::INIT_TIME] = Metrics::now() - initstart;
+      uint64_t playstart = Metrics::now();
+      output->preProcessing();
+
+      error = NULL;
+      double cputime = 0;
+      while (sid.isPlaying)
+      {
+        PlayResult result = driver.play();
+        run.values[Metrics::CYCLES] += driver.state.cpucycles;
+        if (result != PLAY_OK)
+        {
+          run.values[result == PLAY_HALTED ? Metrics::HALTS : Metrics::RUNAWAYS] = 1;
+          error = (result == PLAY_HALTED) ? "CPU halted in playroutine" : "CPU executed abnormally high amount of instructions in playroutine";
+          break;
+        }
+        if (request.maxinstr && driver.instructions > request.maxinstr)
+        {
+          error = "instruction budget exceeded";
+          break;
+        }
+        if (request.maxcpu && sid.time.current_frame % 50 == 0)
+        {
+          cputime = cpuMilliseconds(cpustart);
+          if (cputime > request.maxcpu)
+          {
+            error = "CPU time budget exceeded";
+            break;
+          }
+        }
+
+        sid.update(driver.state.mem);
+        sid.time.cycles = driver.state.cpucycles;
+        output->processCurrentFrame(sid);
+        run.values[Metrics::FRAMES]++;
+        sid.tick();
+      }
+
+      output->postProcessing();
+      run.values[Metrics::PLAY_TIME] = Metrics::now() - playstart;
+      run.values[Metrics::INSTRUCTIONS] = driver.instructions;
+      run.addBytes(request.mode, output->bytesWritten());
+      Metrics::global().finish(run);
+      delete output;
+
+      cputime = cpuMilliseconds(cpustart);
+      if (error)
+        snprintf(status, statussize, "ERROR %s\n", error);
+      else
+        snprintf(status, statussize, "OK frames=%u instructions=%llu cpu=%.3f cached=%d\n",
+          sid.time.current_frame, driver.instructions, cputime, cached ? 1 : 0);
+    }
+
+    // read and parse the request line and the SID file that may follow it
+    const char *readRequest(int fd, Request &request, std::vector<unsigned char> &payload)
+    {
+      char line[MAX_REQUEST + 1];
+      size_t fill = 0;
+      char *newline = NULL;
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += REQUEST_TIMEOUT;
+      while (!newline)
+      {
+        if (fill == MAX_REQUEST)
+          return "request line too long";
+        ssize_t n = receive(fd, &line[fill], MAX_REQUEST - fill, deadline);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == ETIMEDOUT)
+          return "request timed out";
+        if (n <= 0)
+          return "incomplete request";
+        line[fill + n] = 0;
+        newline = strchr(&line[fill], '\n');
+        fill += n;
+      }
+      *newline = 0;
+      payload.assign((unsigned char *)newline + 1, (unsigned char *)&line[fill]);
+
+      for (char *token = strtok(line, " \t\r"); token; token = strtok(NULL, " \t\r"))
+      {
+        char *value = strchr(token, '=');
+        if (!value)
+          return "malformed request";
+        *value++ = 0;
+        if (!parseOption(request, token, value))
+          return "unknown request key";
+      }
+
+      if (request.mode < 0 || request.mode > 12)
+        return "output mode not supported by the server";
+      if (!request.path[0] && !request.size)
+        return "no SID file given";
+      if (request.size > MAX_SIDSIZE)
+        return "SID file too large";
+
+      if (payload.size() > request.size)
+        payload.resize(request.size);
+      while (payload.size() < request.size)
+      {
+        unsigned char buffer[4096];
+        size_t want = request.size - payload.size();
+        ssize_t n = receive(fd, buffer, want < sizeof(buffer) ? want : sizeof(buffer), deadline);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == ETIMEDOUT)
+          return "request timed out";
+        if (n <= 0)
+          return "incomplete SID file";
+        payload.insert(payload.end(), buffer, buffer + n);
+      }
+      return NULL;
+    }
+
+    // recv() that gives up at deadline, with errno ETIMEDOUT, so a slow or
+    // idle client can't hold a worker
+    static ssize_t receive(int fd, void *buffer, size_t size, const struct timespec &deadline)
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long long left = (deadline.tv_sec - now.tv_sec) * 1000000LL + (deadline.tv_nsec - now.tv_nsec) / 1000;
+      if (left <= 0)
+      {
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      struct timeval timeout = {(time_t)(left / 1000000), (suseconds_t)(left % 1000000)};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      ssize_t n = recv(fd, buffer, size, 0);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        errno = ETIMEDOUT;
+      return n;
+    }
+
+    static bool parseOption(Request &request, const char *key, const char *value)
+    {
+      static const struct
+      {
+        const char *name;
+        int SidOutputOptions::*field;
+      } keys[] = {
+        {"seconds", &SidOutputOptions::seconds},
+        {"firstframe", &SidOutputOptions::firstframe},
+        {"spacing", &SidOutputOptions::spacing},
+        {"pattspacing", &SidOutputOptions::pattspacing},
+        {"oldnote", &SidOutputOptions::oldnotefactor},
+        {"lowres", &SidOutputOptions::lowres},
+        {"timeseconds", &SidOutputOptions::timeseconds},
+        {"profiling", &SidOutputOptions::profiling},
+        {"keyframes", &SidOutputOptions::keyframes},
+        {"samplerate", &SidOutputOptions::samplerate}
+      };
+
+      for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+      {
+        if (strcmp(key, keys[i].name))
+          continue;
+        request.options.*keys[i].field = atoi(value);
+        return true;
+      }
+
+      if (!strcmp(key, "mode")) request.mode = atoi(value);
+      else if (!strcmp(key, "subtune")) request.subtune = atoi(value);
+      else if (!strcmp(key, "maxinstr")) request.maxinstr = strtoull(value, NULL, 10);
+      else if (!strcmp(key, "maxcpu")) request.maxcpu = atoi(value);
+      else if (!strcmp(key, "size")) request.size = strtoul(value, NULL, 10);
+      else if (!strcmp(key, "path")) strncpy(request.path, value, sizeof(request.path) - 1);
+      else return false;
+      return true;
+    }
+
+    static double cpuMilliseconds(const struct timespec &start)
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+      return (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6;
+    }
+
+    static void sendAll(int fd, const void *data, size_t size)
+    {
+      const char *p = (const char *)data;
+      while (size)
+      {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        p += n;
+        size -= n;
+      }
+    }
+
+    SidOutputOptions defaults;
+    SidOutputFactory factory;
+    ThreadPool pool;
+    InitCache cache;
+    SnapshotCache *snapshots = NULL;
+};
@@ -24,6 +24,16 @@ struct TimingInfo
   unsigned int current_time;  // in us
   unsigned int end_time;  // in us
   unsigned int current_frame;
+  unsigned int cycles;  // cpu cycles spent in the playroutine this frame
+};
+
+// Compact per-frame record, enough to rebuild a SidState on the other
+// side of a frame queue
+struct SidFrame
+{
+  alignas(32) unsigned char sidreg[32];  // same layout as SidState::packed
+  bool isPlaying;
+  TimingInfo time;
 };
 
 struct SidState
@@ -33,13 +43,17 @@ struct SidState
   TimingInfo time;
   bool isPlaying;
   unsigned int sidreg[27];  // 0-24 sid regs, 25 = dt HI, 26 = dt LO
+  alignas(32) unsigned char packed[32];  // sidreg as bytes, 27-31 always 0
   // unsigned int sidreg[25];
 
   SidState () {isPlaying = false;}
 
   void reset();
   void update(unsigned char *mem);
+  void decode();
   void tick();
+  void save(SidFrame &frame) const;
+  void load(const SidFrame &frame);
   void dumpCurrentState();
 
   int sid_baseaddr = 0xd400;
@@ -51,6 +65,7 @@ void SidState::reset()
   memset(&voice, 0, sizeof(voice));
   memset(&filt, 0, sizeof(filt));
   memset(&sidreg, 0, sizeof(sidreg));
+  memset(&packed, 0, sizeof(packed));
   memset(&time, 0, sizeof(time));
   isPlaying = true;
 }
@@ -58,18 +73,6 @@ void SidState::reset()
 // update sid variables from memory
 void SidState::update(unsigned char *mem)
 {
-    // update properties
-    for (int v = 0; v < 3; v++)
-    {
-      voice[v].freq = mem[sid_baseaddr + 7*v] | (mem[sid_baseaddr + 1 + 7*v] << 8);
-      voice[v].pulse = (mem[sid_baseaddr + 2 + 7*v] | (mem[sid_baseaddr + 3 + 7*v] << 8)) & 0xfff;
-      voice[v].wave = mem[sid_baseaddr + 4 + 7*v];
-      voice[v].adsr = mem[sid_baseaddr + 6 + 7*v] | (mem[sid_baseaddr + 5 + 7*v] << 8);
-    }
-    filt.cutoff = (mem[sid_baseaddr + 0x15] & 0x7) | (mem[sid_baseaddr + 0x16] << 3);
-    filt.ctrl = mem[sid_baseaddr + 0x17];
-    filt.type = mem[sid_baseaddr + 0x18];
-
     // update registers
     for(int i = 0; i < 25; i++)
       sidreg[i] = mem[sid_baseaddr + i];
@@ -84,6 +87,26 @@ void SidState::update(unsigned char *mem)
       sidreg[25] = mem[0xdc05]; // dt HI
       sidreg[26] = mem[0xdc04]; // dt LO
     }
+
+    for(int i = 0; i < 27; i++)
+      packed[i] = sidreg[i];
+
+    decode();
+}
+
+// update properties from the raw registers
+void SidState::decode()
+{
+    for (int v = 0; v < 3; v++)
+    {
+      voice[v].freq = sidreg[7*v] | (sidreg[1 + 7*v] << 8);
+      voice[v].pulse = (sidreg[2 + 7*v] | (sidreg[3 + 7*v] << 8)) & 0xfff;
+      voice[v].wave = sidreg[4 + 7*v];
+      voice[v].adsr = sidreg[6 + 7*v] | (sidreg[5 + 7*v] << 8);
+    }
+    filt.cutoff = (sidreg[0x15] & 0x7) | (sidreg[0x16] << 3);
+    filt.ctrl = sidreg[0x17];
+    filt.type = sidreg[0x18];
 }
 
 // increment frame and time variables based on simulation timings
@@ -96,6 +119,26 @@ void SidState::tick()
       isPlaying = false;
 }
 
+void SidState::save(SidFrame &frame) const
+{
+  memcpy(frame.sidreg, packed, sizeof(packed));
+  frame.isPlaying = isPlaying;
+  frame.time = time;
+}
+
+// note values are not carried in a SidFrame, the outputs derive them
+void SidState::load(const SidFrame &frame)
+{
+  memcpy(packed, frame.sidreg, sizeof(packed));
+  for (int i = 0; i < 27; i++)
+    sidreg[i] = packed[i];
+  for (int v = 0; v < 3; v++)
+    voice[v].note = 0;
+  isPlaying = frame.isPlaying;
+  time = frame.time;
+  decode();
+}
+
 void SidState::dumpCurrentState()
 {
   char output[512];
@@ -0,0 +1,211 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Shared memory ring for handing a live stream to a local process without
+// copying through the kernel. The producer appends bytes at head, the
+// consumer advances tail once it has read them; both are free running
+// byte counts, the data area is used modulo capacity.
+struct StreamShmHeader
+{
+  char magic[4];  // "SDSR"
+  uint32_t capacity;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+};
+
+// Destination of a live stream:
+//   "-" or ""     stdout
+//   fifo:<path>   named pipe, created if missing
+//   unix:<path>   Unix domain stream socket to connect to
+//   shm:<name>    POSIX shared memory ring (see StreamShmHeader)
+class StreamTarget {
+  public:
+    static const uint32_t SHM_CAPACITY = 1 << 16;
+    // seconds the shared memory ring may stay full without the consumer
+    // reading anything before it counts as gone
+    static const unsigned int SHM_TIMEOUT = 5;
+
+    ~StreamTarget() { close(); }
+
+    bool open(const char *target)
+    {
+      signal(SIGPIPE, SIG_IGN);
+
+      if (!target[0] || !strcmp(target, "-"))
+      {
+        // keep the real stdout for the stream, all text goes to stderr
+        fflush(stdout);
+        fd = dup(1);
+        dup2(2, 1);
+        return fd >= 0;
+      }
+      if (!strncmp(target, "fifo:", 5))
+      {
+        if (mkfifo(&target[5], 0666) != 0 && errno != EEXIST)
+          return false;
+        fd = ::open(&target[5], O_WRONLY);
+        return fd >= 0;
+      }
+      if (!strncmp(target, "unix:", 5))
+      {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, &target[5], sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+          ::close(fd);
+          fd = -1;
+        }
+        return fd >= 0;
+      }
+      if (!strncmp(target, "shm:", 4))
+        return openShm(&target[4]);
+      return false;
+    }
+
+    // false once the consumer has gone away
+    bool write(const unsigned char *data, size_t size)
+    {
+      if (shm)
+        return writeShm(data, size);
+      while (size)
+      {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+      }
+      return true;
+    }
+
+    void close()
+    {
+      if (shm)
+      {
+        munmap(shm, sizeof(StreamShmHeader) + shm->capacity);
+        shm = NULL;
+      }
+      if (fd >= 0) ::close(fd);
+      fd = -1;
+    }
+
+  private:
+    bool openShm(const char *name)
+    {
+      int shmfd = shm_open(name, O_RDWR | O_CREAT, 0666);
+      if (shmfd < 0)
+        return false;
+      size_t size = sizeof(StreamShmHeader) + SHM_CAPACITY;
+      if (ftruncate(shmfd, size) != 0)
+      {
+        ::close(shmfd);
+        return false;
+      }
+      void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+      ::close(shmfd);
+      if (p == MAP_FAILED)
+        return false;
+
+      shm = (StreamShmHeader *)p;
+      shm->capacity = SHM_CAPACITY;
+      shm->head.store(0);
+      shm->tail.store(0);
+      memcpy(shm->magic, "SDSR", 4);
+      data = (unsigned char *)(shm + 1);
+      return true;
+    }
+
+    // blocks while the consumer hasn't made room, false if it doesn't
+    // advance tail for SHM_TIMEOUT seconds (or there is none)
+    bool writeShm(const unsigned char *src, size_t size)
+    {
+      uint64_t head = shm->head.load(std::memory_order_relaxed);
+      uint64_t tail = shm->tail.load(std::memory_order_acquire);
+      struct timespec since = {0, 0};
+      for (unsigned int spins = 0; head + size - tail > shm->capacity; spins++)
+      {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!spins)
+          since = now;
+        else if (now.tv_sec - since.tv_sec >= (time_t)SHM_TIMEOUT)
+          return false;
+        // yield for a moment, then poll at a rate that doesn't burn a core
+        if (spins < 1000)
+          sched_yield();
+        else
+        {
+          struct timespec pause = {0, 100000};
+          nanosleep(&pause, NULL);
+        }
+        uint64_t moved = shm->tail.load(std::memory_order_acquire);
+        if (moved != tail)
+        {
+          tail = moved;
+          since = now;
+        }
+      }
+      for (size_t i = 0; i < size; i++)
+        data[(head + i) % shm->capacity] = src[i];
+      shm->head.store(head + size, std::memory_order_release);
+      return true;
+    }
+
+    int fd = -1;
+    StreamShmHeader *shm = NULL;
+    unsigned char *data = NULL;
+};
+
+// Latency statistics of a paced stream, in microseconds
+class PacingStats {
+  public:
+    void add(double latency, double jitter)
+    {
+      latencies.push_back(latency);
+      if (jitter >= 0) jitters.push_back(jitter);
+    }
+
+    void print()
+    {
+      printf("Stream: %u frames\n", (unsigned)latencies.size());
+      printPercentiles("latency", latencies);
+      printPercentiles("jitter", jitters);
+    }
+
+  private:
+    static void printPercentiles(const char *name, std::vector<double> &values)
+    {
+      if (values.empty())
+        return;
+      std::sort(values.begin(), values.end());
+      printf("Stream: %s us p50 %.1f p90 %.1f p99 %.1f max %.1f\n", name,
+        percentile(values, 50), percentile(values, 90), percentile(values, 99), values.back());
+    }
+
+    static double percentile(const std::vector<double> &values, int p)
+    {
+      size_t i = (values.size() - 1) * p / 100;
+      return values[i];
+    }
+
+    std::vector<double> latencies;
+    std::vector<double> jitters;
+};
@@ -0,0 +1,215 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// Simple SID model for listening to a dump. Three oscillators with
+// triangle/saw/pulse/noise (combined waveforms are ANDed), ring
+// modulation, hard sync, the test bit, linear ADSR envelopes and a state
+// variable filter approximation. Not cycle exact, but close enough to
+// check a dump by ear.
+//
+// The voices are processed together: every per-voice quantity is a 4 lane
+// vector (lane 3 unused), so the sample loop compiles to SSE2/NEON code
+// through the GCC/Clang vector extensions.
+
+typedef int32_t v4i __attribute__((vector_size(16)));
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef float v4f __attribute__((vector_size(16)));
+
+#define SID_CLOCK_PAL 985248
+
+class SidSynth {
+  public:
+    // samples are rendered in blocks of at most this many
+    static const int BLOCK_SIZE = 256;
+
+    SidSynth(int samplerate) : samplerate(samplerate)
+    {
+      static const int attackms[16] = {2, 8, 16, 24, 38, 56, 68, 80, 100, 250, 500, 800, 1000, 3000, 5000, 8000};
+      for (int i = 0; i < 16; i++)
+      {
+        attackrate[i] = 255.0f / (attackms[i] / 1000.0f * samplerate);
+        decayrate[i] = attackrate[i] / 3.0f;
+      }
+      reset();
+    }
+
+    void reset()
+    {
+      memset(regs, 0, sizeof(regs));
+      acc = v4u{0, 0, 0, 0};
+      step = v4u{0, 0, 0, 0};
+      noise = v4u{0x7ffff8, 0x7ffff8, 0x7ffff8, 0x7ffff8};
+      env = v4f{0, 0, 0, 0};
+      envstate = v4i{RELEASE, RELEASE, RELEASE, RELEASE};
+      low = band = 0;
+      applyRegisters();
+    }
+
+    // registers 0-24 as written by the playroutine this frame
+    void setRegisters(const unsigned char *sidregs)
+    {
+      for (int v = 0; v < 3; v++)
+      {
+        unsigned char oldctrl = regs[4 + 7*v];
+        unsigned char newctrl = sidregs[4 + 7*v];
+        if ((newctrl & 1) && !(oldctrl & 1)) envstate[v] = ATTACK;
+        if (!(newctrl & 1) && (oldctrl & 1)) envstate[v] = RELEASE;
+      }
+      memcpy(regs, sidregs, sizeof(regs));
+      applyRegisters();
+    }
+
+    // render samples of mono 16 bit PCM
+    void render(int16_t *out, int samples)
+    {
+      while (samples > 0)
+      {
+        int n = samples < BLOCK_SIZE ? samples : BLOCK_SIZE;
+        renderBlock(out, n);
+        out += n;
+        samples -= n;
+      }
+    }
+
+  private:
+    static const int ATTACK = 0;
+    static const int DECAY = 1;
+    static const int RELEASE = 2;
+
+    // the voice that modulates each voice (sync/ring): 3 -> 1 -> 2 -> 3
+    static v4u source(v4u x) { return v4u{x[2], x[0], x[1], x[3]}; }
+    static uint32_t mask(bool b) { return b ? 0xffffffffu : 0u; }
+
+    void applyRegisters()
+    {
+      double scale = (double)SID_CLOCK_PAL / samplerate * 256.0;
+      for (int v = 0; v < 3; v++)
+      {
+        const unsigned char *r = &regs[7*v];
+        unsigned char ctrl = r[4];
+        step[v] = (uint32_t)((r[0] | (r[1] << 8)) * scale);
+        pulsewidth[v] = (r[2] | ((r[3] & 0xf) << 8));
+        seltri[v] = mask(ctrl & 0x10);
+        selsaw[v] = mask(ctrl & 0x20);
+        selpulse[v] = mask(ctrl & 0x40);
+        selnoise[v] = mask(ctrl & 0x80);
+        anywave[v] = mask(ctrl & 0xf0);
+        ring[v] = mask(ctrl & 0x04);
+        sync[v] = mask(ctrl & 0x02);
+        test[v] = mask(ctrl & 0x08);
+        attack[v] = attackrate[r[5] >> 4];
+        decay[v] = decayrate[r[5] & 0xf];
+        release[v] = decayrate[r[6] & 0xf];
+        sustain[v] = (r[6] >> 4) * 17.0f;
+        filtered[v] = (regs[0x17] >> v) & 1;
+      }
+      step[3] = 0;
+      pulsewidth[3] = 0;
+      seltri[3] = selsaw[3] = selpulse[3] = selnoise[3] = anywave[3] = 0;
+      ring[3] = sync[3] = test[3] = 0;
+      attack[3] = decay[3] = release[3] = sustain[3] = 0;
+
+      volume = regs[0x18] & 0xf;
+      voice3off = (regs[0x18] & 0x80) && !(regs[0x17] & 4);
+      filtermode = regs[0x18] & 0x70;
+      int cutoff = (regs[0x15] & 7) | (regs[0x16] << 3);
+      double fc = 30.0 + cutoff * 5.8;
+      if (fc > samplerate / 6.0) fc = samplerate / 6.0;
+      filterf = 2.0f * sin(M_PI * fc / samplerate);
+      filterq = 1.4f - (regs[0x17] >> 4) * (1.2f / 15.0f);
+    }
+
+    void renderBlock(int16_t *out, int samples)
+    {
+      v4f voiceout[BLOCK_SIZE];
+      const v4u bit27 = {1u << 27, 1u << 27, 1u << 27, 1u << 27};
+      const v4u msb = {0x80000000u, 0x80000000u, 0x80000000u, 0x80000000u};
+
+      for (int s = 0; s < samples; s++)
+      {
+        // oscillators, test bit holds the accumulator at zero
+        v4u old = acc;
+        acc = (acc + step) & ~test;
+        v4u srcrise = source(~old & acc & msb);
+        acc &= ~(sync & (v4u)(srcrise != 0));
+
+        // noise LFSR is clocked by bit 19 of the 24 bit accumulator
+        v4u clocked = (v4u)((~old & acc & bit27) != 0);
+        v4u fb = ((noise >> 22) ^ (noise >> 17)) & 1;
+        noise = (((noise << 1) | fb) & 0x7fffff & clocked) | (noise & ~clocked);
+        noise |= test & 0x7ffff8;
+
+        v4u acc24 = acc >> 8;
+        v4u saw = acc24 >> 12;
+        v4u trimsb = (acc ^ (ring & source(acc))) & msb;
+        v4u tri = ((acc24 ^ ((v4u)(trimsb != 0) & 0xffffff)) >> 11) & 0xfff;
+        v4u pulse = ((v4u)(saw >= pulsewidth) | test) & 0xfff;
+        v4u nz = ((noise >> 12) & 0x800) | ((noise >> 10) & 0x400) | ((noise >> 7) & 0x200) |
+                 ((noise >> 5) & 0x100) | ((noise >> 4) & 0x80) | ((noise << 1) & 0x40) |
+                 ((noise << 3) & 0x20) | ((noise << 4) & 0x10);
+
+        v4u wave = (tri | ~seltri) & (saw | ~selsaw) & (pulse | ~selpulse) & (nz | ~selnoise) & anywave & 0xfff;
+
+        // envelopes
+        v4i attacking = envstate == ATTACK;
+        v4i decaying = envstate == DECAY;
+        v4f next = env + attack;
+        next = (v4f)(((v4i)next & attacking) | ((v4i)(env - decay) & decaying) | ((v4i)(env - release) & ~(attacking | decaying)));
+        v4i peaked = attacking & (next >= 255.0f);
+        next = (v4f)(((v4i)(v4f{255, 255, 255, 255}) & peaked) | ((v4i)next & ~peaked));
+        envstate = (envstate & ~peaked) | (DECAY & peaked);
+        v4i floor = decaying & (next < sustain);
+        next = (v4f)(((v4i)sustain & floor) | ((v4i)next & ~floor));
+        next = (v4f)((v4i)next & (next > 0.0f));
+        env = next;
+
+        v4i centered = (v4i)wave - 0x800;
+        voiceout[s] = v4f{(float)centered[0], (float)centered[1], (float)centered[2], 0} * env * (1.0f / 255.0f);
+      }
+
+      // filter and mix, one channel
+      for (int s = 0; s < samples; s++)
+      {
+        float direct = 0, in = 0;
+        for (int v = 0; v < 3; v++)
+        {
+          float x = voiceout[s][v];
+          if (filtered[v]) in += x;
+          else if (v != 2 || !voice3off) direct += x;
+        }
+
+        low += filterf * band;
+        float high = in - low - filterq * band;
+        band += filterf * high;
+
+        float mix = direct;
+        if (filtermode & 0x10) mix += low;
+        if (filtermode & 0x20) mix += band;
+        if (filtermode & 0x40) mix += high;
+
+        float sample = mix * volume * (4.0f / 15.0f);
+        if (sample > 32767) sample = 32767;
+        if (sample < -32768) sample = -32768;
+        out[s] = (int16_t)sample;
+      }
+    }
+
+    int samplerate;
+    unsigned char regs[25];
+    float attackrate[16];
+    float decayrate[16];
+
+    v4u acc, step, noise, pulsewidth;
+    v4u seltri, selsaw, selpulse, selnoise, anywave, ring, sync, test;
+    v4f env, attack, decay, release, sustain;
+    v4i envstate;
+
+    int filtered[3];
+    int volume = 0;
+    bool voice3off = false;
+    int filtermode = 0;
+    float filterf = 0, filterq = 1;
+    float low = 0, band = 0;
+};
@@ -0,0 +1,145 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "SidDriver.h"
+#include "SidDumpReader.h"
+
+// Bump whenever the CPU emulation or the init sequence changes what init
+// leaves behind; snapshots of other versions are ignored.
+#define SNAPSHOT_VERSION 1
+
+// Directory of machine states after init, one small file per tune and
+// subtune, so a repeated run can go straight to the play loop.
+//
+// File, numbers little endian:
+//   "SDSS", u32 version, u64 key (SidTune::hash)
+//   u16 play address, u16 init warnings, u16 page count
+//   u16 pc, u8 a, x, y, flags, sp, u32 cpu cycles
+//   per page init changed: u8 page number, 256 bytes
+// Pages are compared to the memory before init (SidDriver::loadMemory), so
+// a snapshot is usually a few hundred bytes.
+class SnapshotCache {
+  public:
+    SnapshotCache(const char *directory)
+    {
+      snprintf(this->directory, sizeof(this->directory), "%s", directory);
+    }
+
+    // restore the state after init into driver, false if there is no
+    // usable snapshot for this tune
+    bool load(const SidTune &tune, int subtune, SidDriver &driver)
+    {
+      uint64_t key = tune.hash(subtune);
+      char filename[320];
+      path(filename, key);
+
+      MappedFile file;
+      if (!file.open(filename) || file.size < HEADER_SIZE)
+        return false;
+      const unsigned char *p = file.data;
+      if (memcmp(p, "SDSS", 4) || get32(&p[4]) != SNAPSHOT_VERSION ||
+          get32(&p[8]) != (uint32_t)key || get32(&p[12]) != (uint32_t)(key >> 32))
+        return false;
+      unsigned pages = get16(&p[20]);
+      if (file.size != HEADER_SIZE + pages * 257)
+        return false;
+
+      SidDriver::Snapshot snapshot;
+      memset(&snapshot.state, 0, sizeof(snapshot.state));
+      SidDriver::loadMemory(tune, snapshot.state.mem);
+      snapshot.playaddress = get16(&p[16]);
+      snapshot.initwarnings = get16(&p[18]);
+      snapshot.state.pc = get16(&p[22]);
+      snapshot.state.a = p[24];
+      snapshot.state.x = p[25];
+      snapshot.state.y = p[26];
+      snapshot.state.flags = p[27];
+      snapshot.state.sp = p[28];
+      snapshot.state.cpucycles = get32(&p[29]);
+
+      const unsigned char *page = &p[HEADER_SIZE];
+      for (unsigned i = 0; i < pages; i++, page += 257)
+        memcpy(&snapshot.state.mem[page[0] << 8], &page[1], 256);
+
+      driver.restore(snapshot);
+      return true;
+    }
+
+    // store the state driver is in right after init
+    bool save(const SidTune &tune, int subtune, const SidDriver &driver)
+    {
+      uint64_t key = tune.hash(subtune);
+      std::vector<unsigned char> before(0x10000);
+      SidDriver::loadMemory(tune, before.data());
+
+      const CpuState &state = driver.state;
+      std::vector<unsigned char> data;
+      data.insert(data.end(), "SDSS", "SDSS" + 4);
+      put32(data, SNAPSHOT_VERSION);
+      put32(data, (uint32_t)key);
+      put32(data, (uint32_t)(key >> 32));
+      put16(data, driver.playaddress);
+      put16(data, driver.initwarnings);
+      put16(data, 0);
+      put16(data, state.pc);
+      data.push_back(state.a);
+      data.push_back(state.x);
+      data.push_back(state.y);
+      data.push_back(state.flags);
+      data.push_back(state.sp);
+      put32(data, state.cpucycles);
+
+      unsigned pages = 0;
+      for (unsigned page = 0; page < 256; page++)
+      {
+        if (!memcmp(&state.mem[page << 8], &before[page << 8], 256))
+          continue;
+        data.push_back(page);
+        data.insert(data.end(), &state.mem[page << 8], &state.mem[(page << 8) + 256]);
+        pages++;
+      }
+      data[20] = pages & 0xff;
+      data[21] = pages >> 8;
+
+      // written under a temporary name, so a concurrent run never reads
+      // half a file
+      char filename[320], temp[340];
+      path(filename, key);
+      snprintf(temp, sizeof(temp), "%s.%d", filename, (int)getpid());
+      FILE *out = fopen(temp, "wb");
+      if (!out)
+        return false;
+      bool ok = fwrite(data.data(), data.size(), 1, out) == 1;
+      ok = (fclose(out) == 0) && ok;
+      if (ok)
+        ok = rename(temp, filename) == 0;
+      if (!ok)
+        unlink(temp);
+      return ok;
+    }
+
+  private:
+    static const size_t HEADER_SIZE = 33;
+
+    void path(char *dest, uint64_t key) const
+    {
+      snprintf(dest, 320, "%s/%016llx.v%d.snap", directory, (unsigned long long)key, SNAPSHOT_VERSION);
+    }
+
+    static unsigned get16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+    static void put16(std::vector<unsigned char> &dest, unsigned v)
+    {
+      dest.push_back(v & 0xff);
+      dest.push_back((v >> 8) & 0xff);
+    }
+    static void put32(std::vector<unsigned char> &dest, uint32_t v)
+    {
+      put16(dest, v & 0xffff);
+      put16(dest, v >> 16);
+    }
+
+    char directory[256] = {0};
+};
@@ -0,0 +1,292 @@
+#pragma once
+#include <stdio.h>
+#include <math.h>
+#include <complex>
+#include <vector>
+#include "SidOutput.h"
+
+// In place radix-2 FFT, the size a power of two; the inverse is not
+// scaled.
+static void fft(std::vector<std::complex<double> > &a, bool inverse)
+{
+  size_t n = a.size();
+  for (size_t i = 1, j = 0; i < n; i++)
+  {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      std::swap(a[i], a[j]);
+  }
+  for (size_t length = 2; length <= n; length <<= 1)
+  {
+    double angle = 2 * M_PI / length * (inverse ? 1 : -1);
+    std::complex<double> step(cos(angle), sin(angle));
+    for (size_t i = 0; i < n; i += length)
+    {
+      std::complex<double> w(1);
+      for (size_t k = 0; k < length / 2; k++, w *= step)
+      {
+        std::complex<double> u = a[i + k], v = a[i + k + length / 2] * w;
+        a[i + k] = u + v;
+        a[i + k + length / 2] = u - v;
+      }
+    }
+  }
+}
+
+// Estimates the row speed and pattern length of a tune from the frames
+// it plays, for the note listing's -n and -p.
+//
+// Each frame's gate ons and note changes (notes found as the listing
+// does) are counted as they come; their autocorrelation peaks at
+// multiples of the row speed, and the frame within a row where most of
+// them fall gives where rows start. Notes are also kept per voice and
+// pitch class: summed over those, the autocorrelation counts the notes
+// that come again after a lag, and the pattern length is the number of
+// rows after which most of them do. The autocorrelations are done with
+// the FFT, O(n log n) in the frames.
+class TempoEstimate {
+  public:
+    // frames per row in the range searched, and rows per pattern
+    static const unsigned int MIN_SPEED = 2, MAX_SPEED = 32;
+    static const unsigned int MIN_PATTERN = 8, MAX_PATTERN = 128;
+
+    TempoEstimate(const SidOutputOptions *opts)
+    {
+      ScreenOutputWithNotes::buildNoteTable(notes, opts);
+    }
+
+    void frame(const SidState &current)
+    {
+      unsigned int events = 0;
+      for (int v = 0; v < 3; v++)
+      {
+        const Voice &voice = current.voice[v];
+        if (voice.wave >= 0x10)
+        {
+          bool keyon = (voice.wave & 1) && (!(wave[v] & 1) || wave[v] < 0x10);
+          if (keyon)
+            sticky[v] = NoteTable::NO_NOTE;
+          int note = notes.find(voice.freq, sticky[v]);
+          if (keyon || note != sticky[v])
+          {
+            events++;
+            if (note >= 0)
+              played.push_back(Event{(unsigned int)counts.size(), (unsigned char)(v * 12 + note % 12)});
+          }
+          sticky[v] = note;
+        }
+        wave[v] = voice.wave;
+      }
+      counts.push_back(events);
+    }
+
+    // false if there are too few notes to tell
+    bool estimate()
+    {
+      size_t n = counts.size();
+      if (played.size() < 2 * MIN_PATTERN || n < 4 * MAX_SPEED)
+        return false;
+
+      // row speed: the shortest lag of nearly the highest correlation,
+      // as every multiple of the speed correlates about as well
+      double mean = 0;
+      for (size_t i = 0; i < n; i++)
+        mean += counts[i];
+      mean /= n;
+      std::vector<std::vector<double> > signal(1, std::vector<double>(n));
+      for (size_t i = 0; i < n; i++)
+        signal[0][i] = counts[i] - mean;
+      std::vector<double> r = autocorrelation(signal, MAX_SPEED + 1);
+      if (r[0] <= 0)
+        return false;
+      double best = 0;
+      for (unsigned int lag = MIN_SPEED; lag <= MAX_SPEED; lag++)
+        best = std::max(best, r[lag] / (n - lag));
+      if (best <= 0)
+        return false;
+      for (speed = MIN_SPEED; r[speed] / (n - speed) < 0.85 * best; speed++)
+        ;
+
+      std::vector<double> phases(speed);
+      for (size_t i = 0; i < n; i++)
+        phases[i % speed] += counts[i];
+      phase = std::max_element(phases.begin(), phases.end()) - phases.begin();
+
+      // pattern length: the lag, in whole rows, after which the largest
+      // share of notes comes again on the same voice and pitch class
+      std::vector<std::vector<double> > channels(36, std::vector<double>(n));
+      for (size_t i = 0; i < played.size(); i++)
+        channels[played[i].channel][played[i].frame] += 1;
+      size_t longest = std::min((size_t)MAX_PATTERN * speed, n / 2);
+      std::vector<double> matches = autocorrelation(channels, longest + 1);
+      double bestshare = 0;
+      pattern = 0;
+      std::vector<double> share(MAX_PATTERN + 1);
+      for (unsigned int rows = MIN_PATTERN; rows <= MAX_PATTERN && rows * speed <= longest; rows++)
+      {
+        share[rows] = matches[rows * speed] / (n - rows * speed);
+        bestshare = std::max(bestshare, share[rows]);
+      }
+      for (unsigned int rows = MIN_PATTERN; rows <= MAX_PATTERN && rows * speed <= longest; rows++)
+        if (share[rows] >= 0.95 * bestshare && bestshare > 0)
+        {
+          pattern = rows;
+          break;
+        }
+      return true;
+    }
+
+    unsigned int speed = 0;    // frames per row
+    unsigned int phase = 0;    // frame of the dump the first row starts at
+    unsigned int pattern = 0;  // rows per pattern, 0 if none was found
+
+  private:
+    struct Event
+    {
+      unsigned int frame;
+      unsigned char channel;  // voice * 12 + pitch class
+    };
+
+    // the sum of the signals' autocorrelations for lags 0 to lags - 1:
+    // their power spectra are added up, zero padded against wraparound,
+    // and transformed back once
+    static std::vector<double> autocorrelation(const std::vector<std::vector<double> > &signals, size_t lags)
+    {
+      size_t n = signals[0].size(), size = 1;
+      while (size < 2 * n)
+        size <<= 1;
+      std::vector<std::complex<double> > power(size), spectrum(size);
+      for (size_t s = 0; s < signals.size(); s++)
+      {
+        std::fill(spectrum.begin(), spectrum.end(), std::complex<double>(0));
+        for (size_t i = 0; i < n; i++)
+          spectrum[i] = signals[s][i];
+        fft(spectrum, false);
+        for (size_t i = 0; i < size; i++)
+          power[i] += std::norm(spectrum[i]);
+      }
+      fft(power, true);
+      std::vector<double> r(lags);
+      for (size_t i = 0; i < lags && i < n; i++)
+        r[i] = power[i].real() / size;
+      return r;
+    }
+
+    NoteTable notes;
+    unsigned char wave[3] = {0};
+    int sticky[3] = {NoteTable::NO_NOTE, NoteTable::NO_NOTE, NoteTable::NO_NOTE};
+    std::vector<unsigned int> counts;
+    std::vector<Event> played;
+};
+
+// Estimates the tempo from the frames a dump goes through and prints it.
+// With apply, the wrapped output (the note listing) gets the frames only
+// at the end (or where the run stops early), after -n and -p have been
+// set from the estimate, with the separators lined up on the rows.
+class TempoOutput : public SidOutput {
+  public:
+    TempoOutput(SidOutput *sink, bool apply) : inner(sink), apply(apply) {}
+
+    virtual ~TempoOutput()
+    {
+      delete inner;
+      delete tempo;
+    }
+
+    // the listing drops -l without -n, so with apply it sees the
+    // options only once -n is set
+    virtual void setOptions(SidOutputOptions *options)
+    {
+      opts = options;
+      if (!apply)
+        inner->setOptions(options);
+    }
+
+    virtual void preProcessing()
+    {
+      tempo = new TempoEstimate(opts);
+      if (!apply)
+        inner->preProcessing();
+    }
+
+    virtual void processCurrentFrame(const SidState &current)
+    {
+      tempo->frame(current);
+      if (!apply)
+      {
+        inner->processCurrentFrame(current);
+        return;
+      }
+      frames.push_back(SidFrame());
+      current.save(frames.back());
+    }
+
+    // with apply the listing is only printed here, so on an early stop
+    // it is made of the frames up to there
+    virtual void flush()
+    {
+      if (apply)
+        replay(report());
+      inner->flush();
+    }
+
+    virtual unsigned long long bytesWritten() { return inner->bytesWritten(); }
+
+    virtual void postProcessing()
+    {
+      bool found = report();
+      if (apply)
+        replay(found);
+      inner->postProcessing();
+    }
+
+  private:
+    // print the estimate, false if there is none
+    bool report()
+    {
+      bool found = tempo->estimate();
+      if (!found)
+        printf("Tempo: too few notes to estimate the tempo from\n");
+      else
+      {
+        printf("Tempo: rows of %u frames, starting at frame %u", tempo->speed, opts->firstframe + tempo->phase);
+        if (tempo->pattern)
+          printf(", patterns of %u rows", tempo->pattern);
+        printf("\n");
+      }
+      return found;
+    }
+
+    // the buffered frames into the listing, with -n and -p set from the
+    // estimate if there is one
+    void replay(bool found)
+    {
+      if (found)
+      {
+        opts->spacing = tempo->speed;
+        if (!opts->pattspacing)
+          opts->pattspacing = tempo->pattern;
+        // a separator follows the frame that fills the row, so the first
+        // one comes before the first row that starts in the dump and
+        // begins a pattern
+        opts->counter = (tempo->speed - tempo->phase) % tempo->speed;
+        opts->rows = tempo->phase && opts->pattspacing ? opts->pattspacing - 1 : 0;
+      }
+      inner->setOptions(opts);
+      inner->preProcessing();
+      SidState current;
+      for (size_t i = 0; i < frames.size(); i++)
+      {
+        current.load(frames[i]);
+        inner->processCurrentFrame(current);
+      }
+    }
+
+    SidOutput *inner;
+    bool apply;
+    TempoEstimate *tempo = NULL;
+    std::vector<SidFrame> frames;
+};
@@ -0,0 +1,154 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+
+// Small formatting engine for the screen outputs. A TextLine is a
+// fixed buffer with a write cursor; every emitter appends at the cursor,
+// so building a row costs one pass over its bytes instead of the
+// sprintf(&output[strlen(output)], ...) rescans. Hex and decimal digits
+// come from lookup tables, widths are given per call the way printf's
+// "%0nX", "%nd" and "%0nd" would pad them.
+class TextLine {
+  public:
+    static const int SIZE = 1024;
+
+    TextLine() { reset(); }
+
+    void reset() { pos = buf; }
+    int length() const { return pos - buf; }
+    const char *data() const { return buf; }
+
+    TextLine &chr(char c)
+    {
+      *pos++ = c;
+      return *this;
+    }
+
+    TextLine &str(const char *s)
+    {
+      while (*s) *pos++ = *s++;
+      return *this;
+    }
+
+    // string literal of known length, copied without scanning
+    template <int N>
+    TextLine &lit(const char (&s)[N])
+    {
+      memcpy(pos, s, N - 1);
+      pos += N - 1;
+      return *this;
+    }
+
+    // "%02X": two digits from the pair table
+    TextLine &hex2(unsigned int v)
+    {
+      if (v > 0xff) return hex(v, 2);
+      memcpy(pos, &hexpairs.digits[v * 2], 2);
+      pos += 2;
+      return *this;
+    }
+
+    // "%04X"
+    TextLine &hex4(unsigned int v)
+    {
+      if (v > 0xffff) return hex(v, 4);
+      memcpy(pos, &hexpairs.digits[(v >> 8) * 2], 2);
+      memcpy(pos + 2, &hexpairs.digits[(v & 0xff) * 2], 2);
+      pos += 4;
+      return *this;
+    }
+
+    // "%0<width>X" for any value, grows past width like printf does
+    TextLine &hex(unsigned int v, int width)
+    {
+      int n = 1;
+      while (n < 8 && (v >> (n * 4))) n++;
+      if (n < width) n = width;
+      for (int i = n - 1; i >= 0; i--)
+      {
+        pos[i] = hexdigits[v & 0xf];
+        v >>= 4;
+      }
+      pos += n;
+      return *this;
+    }
+
+    // "%<width>d", or "%0<width>d" with zeropad set
+    TextLine &dec(int v, int width, bool zeropad = false)
+    {
+      char digits[12];
+      unsigned int u = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+      char *end = digits + sizeof(digits);
+      char *d = end;
+
+      while (u >= 100)
+      {
+        d -= 2;
+        memcpy(d, &decpairs.digits[(u % 100) * 2], 2);
+        u /= 100;
+      }
+      if (u >= 10)
+      {
+        d -= 2;
+        memcpy(d, &decpairs.digits[u * 2], 2);
+      }
+      else
+        *--d = '0' + u;
+
+      int len = (end - d) + (v < 0);
+      if (!zeropad)
+        for (; len < width; len++) *pos++ = ' ';
+      if (v < 0) *pos++ = '-';
+      if (zeropad)
+        for (; len < width; len++) *pos++ = '0';
+      memcpy(pos, d, end - d);
+      pos += end - d;
+      return *this;
+    }
+
+    // write the line and start over, returns the number of bytes written
+    int print(FILE *f)
+    {
+      int len = length();
+      fwrite(buf, 1, len, f);
+      reset();
+      return len;
+    }
+
+  private:
+    struct HexPairs
+    {
+      char digits[512];
+      HexPairs()
+      {
+        for (int i = 0; i < 256; i++)
+        {
+          digits[i * 2] = hexdigits[i >> 4];
+          digits[i * 2 + 1] = hexdigits[i & 0xf];
+        }
+      }
+    };
+
+    struct DecimalPairs
+    {
+      char digits[200];
+      DecimalPairs()
+      {
+        for (int i = 0; i < 100; i++)
+        {
+          digits[i * 2] = '0' + i / 10;
+          digits[i * 2 + 1] = '0' + i % 10;
+        }
+      }
+    };
+
+    static constexpr const char *hexdigits = "0123456789ABCDEF";
+    static const HexPairs hexpairs;
+    static const DecimalPairs decpairs;
+
+    char buf[SIZE];
+    char *pos;
+};
+
+const TextLine::HexPairs TextLine::hexpairs;
+const TextLine::DecimalPairs TextLine::decpairs;
@@ -0,0 +1,71 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+// Fixed size pool of worker threads running queued jobs in FIFO order.
+class ThreadPool {
+  public:
+    ThreadPool(unsigned int threads)
+    {
+      if (threads < 1) threads = 1;
+      for (unsigned int i = 0; i < threads; i++)
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+      }
+      cond.notify_all();
+      for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    }
+
+    void submit(std::function<void()> job)
+    {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        jobs.push_back(job);
+      }
+      cond.notify_one();
+    }
+
+    unsigned int size() const { return workers.size(); }
+
+    // worker count to use when none is given: one per hardware thread
+    static unsigned int defaultSize()
+    {
+      unsigned int n = std::thread::hardware_concurrency();
+      return n ? n : 1;
+    }
+
+  private:
+    void workerLoop()
+    {
+      for (;;)
+      {
+        std::function<void()> job;
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          cond.wait(guard, [this] { return stopping || !jobs.empty(); });
+          if (jobs.empty())
+            return;
+          job = jobs.front();
+          jobs.pop_front();
+        }
+        job();
+      }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > jobs;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool stopping = false;
+};
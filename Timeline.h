@@ -0,0 +1,215 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of where a run spends its time: begin and end of init and, per
+// frame, the playroutine call, SidState::update() and the output (sink).
+// Saved as Chrome trace-event JSON, which Perfetto (ui.perfetto.dev) and
+// chrome://tracing show with a track per thread.
+//
+// Each thread records into a ring of its own, so a span costs two clock
+// reads and a store, without locking; a thread only takes the lock the
+// first time it records, to register its track. A long run keeps the last
+// events of every thread in its ring, while the per stage totals cover
+// all of it.
+class Timeline {
+  public:
+    enum Stage { INIT, PLAY, UPDATE, SINK, STAGES };
+
+    // events kept per thread
+    static const unsigned int EVENTS = 1 << 16;
+
+    Timeline(unsigned int events = EVENTS) : size(roundUp(events)), start(now()) {}
+
+    ~Timeline()
+    {
+      for (size_t i = 0; i < tracks.size(); i++)
+        delete tracks[i];
+    }
+
+    // the timeline being recorded, NULL when there is none; spans then
+    // cost no more than this test
+    static Timeline *&active()
+    {
+      static Timeline *timeline = NULL;
+      return timeline;
+    }
+
+    static uint64_t now()
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void record(Stage stage, uint64_t begin, uint64_t end, unsigned int frame)
+    {
+      Track &t = track();
+      Event &e = t.ring[t.recorded++ & (size - 1)];
+      e.begin = begin;
+      e.duration = end - begin;
+      e.stage = stage;
+      e.frame = frame;
+      Total &total = t.totals[stage];
+      total.count++;
+      total.time += end - begin;
+      if (end - begin > total.longest)
+        total.longest = end - begin;
+    }
+
+    // name of the calling thread's track, "main" if it is never set
+    void nameThread(const char *name) { track().name = name; }
+
+    // false if the file couldn't be written
+    bool save(const char *filename)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      FILE *out = fopen(filename, "w");
+      if (!out)
+        return false;
+      fprintf(out, "{\"displayTimeUnit\": \"ms\",\n\"traceEvents\": [\n");
+      fprintf(out, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"siddump\"}}");
+      for (size_t i = 0; i < tracks.size(); i++)
+      {
+        const Track &t = *tracks[i];
+        fprintf(out, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": "
+          "\"%s\"}}", (unsigned)i + 1, t.name.c_str());
+        uint64_t first = t.recorded > size ? t.recorded - size : 0;
+        for (uint64_t n = first; n < t.recorded; n++)
+        {
+          const Event &e = t.ring[n & (size - 1)];
+          fprintf(out, ",\n  {\"name\": \"%s\", \"cat\": \"siddump\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+            "\"ts\": %.3f, \"dur\": %.3f", stageName(e.stage), (unsigned)i + 1, (e.begin - start) / 1000.0,
+            e.duration / 1000.0);
+          if (e.stage != INIT)
+            fprintf(out, ", \"args\": {\"frame\": %u}", e.frame);
+          fprintf(out, "}");
+        }
+      }
+      // the totals, for runs longer than the rings
+      fprintf(out, "\n],\n\"otherData\": {");
+      const char *separator = "";
+      for (size_t i = 0; i < tracks.size(); i++)
+        for (int s = 0; s < STAGES; s++)
+        {
+          const Total &total = tracks[i]->totals[s];
+          if (!total.count)
+            continue;
+          fprintf(out, "%s\n  \"%s %u %s\": \"%llu spans, %.3f ms, longest %.3f us\"", separator,
+            tracks[i]->name.c_str(), (unsigned)i + 1, stageName(s), total.count, total.time / 1e6,
+            total.longest / 1e3);
+          separator = ",";
+        }
+      fprintf(out, "\n}}\n");
+      return fclose(out) == 0;
+    }
+
+    // the totals per thread and stage
+    void print()
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (size_t i = 0; i < tracks.size(); i++)
+      {
+        const Track &t = *tracks[i];
+        for (int s = 0; s < STAGES; s++)
+        {
+          const Total &total = t.totals[s];
+          if (!total.count)
+            continue;
+          printf("Timeline: %s %s %llu spans, %.3f ms, average %.2f us, longest %.2f us\n", t.name.c_str(),
+            stageName(s), total.count, total.time / 1e6, total.time / 1e3 / total.count, total.longest / 1e3);
+        }
+        if (t.recorded > size)
+          printf("Timeline: %s kept the last %u of %llu spans\n", t.name.c_str(), size,
+            (unsigned long long)t.recorded);
+      }
+    }
+
+  private:
+    struct Event
+    {
+      uint64_t begin;
+      uint64_t duration;
+      uint16_t stage;
+      uint32_t frame;
+    };
+
+    struct Total
+    {
+      unsigned long long count = 0;
+      unsigned long long time = 0;
+      unsigned long long longest = 0;
+    };
+
+    struct Track
+    {
+      Track(unsigned int size) : name("main"), ring(size) {}
+
+      std::string name;
+      std::vector<Event> ring;
+      uint64_t recorded = 0;
+      Total totals[STAGES];
+    };
+
+    // the calling thread's track, registered the first time
+    Track &track()
+    {
+      static thread_local Track *mine = NULL;
+      static thread_local Timeline *owner = NULL;
+      if (owner != this)
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        mine = new Track(size);
+        tracks.push_back(mine);
+        owner = this;
+      }
+      return *mine;
+    }
+
+    static const char *stageName(int stage)
+    {
+      static const char *const names[STAGES] = {"init", "play", "update", "sink"};
+      return names[stage];
+    }
+
+    static unsigned int roundUp(unsigned int n)
+    {
+      unsigned int size = 1;
+      while (size < n && size < 0x80000000u)
+        size <<= 1;
+      return size;
+    }
+
+    unsigned int size;
+    uint64_t start;
+    std::mutex lock;
+    std::vector<Track *> tracks;
+};
+
+// Records the time from its construction to the end of its scope as a
+// span of the active timeline, if there is one.
+class TimelineSpan {
+  public:
+    TimelineSpan(Timeline::Stage stage, unsigned int frame = 0)
+      : timeline(Timeline::active()), stage(stage), frame(frame)
+    {
+      if (timeline)
+        begin = Timeline::now();
+    }
+
+    ~TimelineSpan()
+    {
+      if (timeline)
+        timeline->record(stage, begin, Timeline::now(), frame);
+    }
+
+  private:
+    Timeline *timeline;
+    Timeline::Stage stage;
+    unsigned int frame;
+    uint64_t begin = 0;
+};
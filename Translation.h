@@ -0,0 +1,153 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+
+// Playroutines translated ahead of time to C++ (see Translator.h). The
+// generated file has a function per basic block and registers itself when
+// it is linked in; the driver then runs the blocks instead of interpreting
+// the instructions one at a time, and interprets wherever there is no
+// block or the code in memory differs from what was translated.
+
+// Access policy of translated instructions: the opcode and operands are
+// compile time constants, except operand bytes the playroutine modifies
+// itself or that are left relocatable (-1), which are read from memory. A
+// write to any translated code byte is noted in modified, so the block
+// stops right after it. The address makes every instruction a template
+// instance of its own, which the compiler inlines once it has folded it.
+template <unsigned ADDRESS, int OP, int LO, int HI>
+struct FixedAccess
+{
+  unsigned char *mem;
+  const unsigned char *const *fixed;  // per page bitmaps of the translated code bytes
+  bool modified;
+
+  unsigned char &at(unsigned a) { return mem[a]; }
+  unsigned char opcode(unsigned) { return OP; }
+  unsigned char operand(unsigned a)
+  {
+    if (a == ADDRESS + 1)
+      return LO >= 0 ? LO : mem[a];
+    return HI >= 0 ? HI : mem[a];
+  }
+  void written(unsigned a)
+  {
+    const unsigned char *page = fixed[(a >> 8) & 0xff];
+    if (page && (page[(a & 0xff) >> 3] & (1 << (a & 7))))
+      modified = true;
+  }
+};
+
+// Runs the block starting at state.pc and returns the instructions it
+// executed, 0 if there is no block there or its code has changed. running
+// is cleared when the last of them ends the call (RTS/RTI with an empty
+// stack, BRK), as runcpu() would return.
+typedef int (*TranslatedBlocks)(CpuState &state, int &running);
+
+struct Translation
+{
+  Translation(uint64_t key, uint64_t engine, TranslatedBlocks run, unsigned int blocks)
+    : key(key), engine(engine), run(run), blocks(blocks), next(list())
+  {
+    list() = this;
+  }
+
+  // the translation linked in for a tune and subtune (SidTune::hash), else
+  // one of another tune with the same engine (engineFingerprint). The
+  // blocks check their code, so what that tune doesn't share is
+  // interpreted.
+  static const Translation *find(uint64_t key, uint64_t engine)
+  {
+    const Translation *found = NULL;
+    for (const Translation *t = list(); t; t = t->next)
+    {
+      if (t->key == key)
+        return t;
+      if (t->engine == engine && !found)
+        found = t;
+    }
+    return found;
+  }
+
+  uint64_t key;
+  uint64_t engine;
+  TranslatedBlocks run;
+  unsigned int blocks;
+
+  private:
+    static Translation *&list()
+    {
+      static Translation *head = NULL;
+      return head;
+    }
+
+    Translation *next;
+};
+
+// A translation in use by a driver. With verify, every block is also
+// interpreted on a copy of the machine and the results compared.
+class TranslatedCode {
+  public:
+    TranslatedCode(const Translation *translation, bool verify) : translation(translation)
+    {
+      if (verify) scratch = new CpuState;
+    }
+
+    ~TranslatedCode() { delete scratch; }
+
+    // as Translation::run
+    int run(CpuState &state, int &running)
+    {
+      if (scratch)
+        *scratch = state;
+      int n = translation->run(state, running);
+      if (!n)
+      {
+        interpreted++;
+        return 0;
+      }
+      blocks++;
+      translated += n;
+      if (scratch)
+        check(state, n, running);
+      return n;
+    }
+
+    void print() const
+    {
+      unsigned long long total = translated + interpreted;
+      printf("Translation: %llu blocks run, %llu of %llu instructions translated (%.1f%%)", blocks,
+        translated, total, total ? translated * 100.0 / total : 0.0);
+      if (scratch)
+        printf(", %u mismatches", mismatches);
+      printf("\n");
+    }
+
+  private:
+    void check(const CpuState &state, int n, int running)
+    {
+      CpuState *saved = cpu;
+      cpu = scratch;
+      int interpreting = 1;
+      for (int i = 0; i < n && interpreting; i++)
+        interpreting = runcpu();
+      cpu = saved;
+
+      if (interpreting == running && !memcmp(scratch->mem, state.mem, sizeof(state.mem)) &&
+          scratch->cpucycles == state.cpucycles && scratch->pc == state.pc && scratch->a == state.a &&
+          scratch->x == state.x && scratch->y == state.y && scratch->flags == state.flags && scratch->sp == state.sp)
+        return;
+      if (mismatches++ < 10)
+        printf("Translation: mismatch in block ending at $%04X, A=%02X X=%02X Y=%02X P=%02X S=%02X, interpreter "
+          "PC=%04X A=%02X X=%02X Y=%02X P=%02X S=%02X\n", state.pc, state.a, state.x, state.y, state.flags,
+          state.sp, scratch->pc, scratch->a, scratch->x, scratch->y, scratch->flags, scratch->sp);
+    }
+
+    const Translation *translation;
+    CpuState *scratch = NULL;
+    unsigned long long blocks = 0;
+    unsigned long long translated = 0;
+    unsigned long long interpreted = 0;
+    unsigned int mismatches = 0;
+};
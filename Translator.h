@@ -0,0 +1,306 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "cpu.h"
+
+// Translates a tune's code ahead of time into a C++ file with a function
+// per basic block, for Translation.h. It is attached to the driver as the
+// tracer for a whole run: every instruction executed, in init or play, is
+// a starting point, and from those the code is followed statically along
+// branches, jumps and subroutine calls.
+//
+// The code bytes are taken from memory as init left it. Operand bytes the
+// playroutine writes are read from memory at run time, instructions whose
+// opcode it writes are left to the interpreter. Each block compares its
+// code bytes with memory before it runs, so it is only used while the
+// code is still the same.
+class Translator : public CpuObserver {
+  public:
+    // relocatable: absolute addresses in the code are read from memory
+    // rather than translated, so the translation fits every tune with the
+    // same engine at the same address, whatever its data layout
+    Translator(bool relocatable = false)
+      : relocatable(relocatable), executed(0x10000), written(0x10000), image(0x10000) {}
+
+    virtual void opcode(unsigned address) { executed[address & 0xffff] = 1; }
+    virtual void operand(unsigned) {}
+    virtual void read(unsigned) {}
+    virtual void write(unsigned address) { written[address & 0xffff] = 1; }
+
+    // after init: keep its memory, only the playroutine's writes count
+    // as code modification from here on
+    void initDone(const CpuState &state, unsigned initaddress, unsigned playaddress)
+    {
+      memcpy(image.data(), state.mem, 0x10000);
+      std::fill(written.begin(), written.end(), 0);
+      entries[0] = initaddress;
+      entries[1] = playaddress;
+    }
+
+    // write the translation for the tune identified by key (SidTune::hash)
+    // and its engine (engineFingerprint), false if the file couldn't be
+    // written
+    bool save(const char *filename, const char *tunename, uint64_t key, uint64_t engine)
+    {
+      findCode();
+      findBlocks();
+
+      FILE *out = fopen(filename, "w");
+      if (!out)
+        return false;
+      fprintf(out, "// %s translated by siddump --translate. Compile and link with siddump.cpp\n"
+        "// and cpu.cpp to run its code without interpreting it; outside the siddump\n"
+        "// source directory, add -I with that directory for the headers below.\n"
+        "#include <string.h>\n#include \"cpuexec.h\"\n#include \"Translation.h\"\n\n", tunename);
+      writeFixedBytes(out);
+      for (size_t i = 0; i < blocks.size(); i++)
+        writeBlock(out, blocks[i]);
+
+      fprintf(out, "static int run(CpuState &state, int &running)\n{\n  switch (state.pc)\n  {\n");
+      for (size_t i = 0; i < blocks.size(); i++)
+        fprintf(out, "    case 0x%04x: return block_%04x(state, running);\n", blocks[i], blocks[i]);
+      fprintf(out, "  }\n  return 0;\n}\n\n");
+      fprintf(out, "static Translation translation(0x%016llxull, 0x%016llxull, run, %u);\n",
+        (unsigned long long)key, (unsigned long long)engine, (unsigned)blocks.size());
+      return fclose(out) == 0;
+    }
+
+    unsigned int blockCount() const { return blocks.size(); }
+    unsigned int instructionCount() const { return instructions; }
+
+  private:
+    enum { NONE, INSTRUCTION, LEADER };
+
+    static int length(unsigned char op) { return opcodelength(op); }
+
+    static bool isBranch(unsigned char op) { return (op & 0x1f) == 0x10; }
+
+    // the instruction ends its block: control goes elsewhere
+    static bool endsBlock(unsigned char op)
+    {
+      return isBranch(op) || op == 0x00 || op == 0x20 || op == 0x40 || op == 0x4c || op == 0x60 || op == 0x6c;
+    }
+
+    // translatable instruction at address
+    bool decodable(unsigned address) const
+    {
+      unsigned char op = image[address];
+      return !written[address] && length(op) && address + length(op) <= 0x10000;
+    }
+
+    // byte i of the instruction at address, -1 if the playroutine changes it
+    int constantByte(unsigned address, int i) const
+    {
+      if (address + i >= 0x10000 || written[address + i])
+        return -1;
+      return image[address + i];
+    }
+
+    // byte i as the translation has it, -1 if it is read from memory
+    int fixedByte(unsigned address, int i) const
+    {
+      if (relocatable && i && length(image[address]) == 3)
+        return -1;
+      return constantByte(address, i);
+    }
+
+    void findCode()
+    {
+      kind.assign(0x10000, NONE);
+      std::vector<unsigned> work;
+      for (unsigned a = 0; a < 0x10000; a++)
+        if (executed[a]) work.push_back(a);
+      addTarget(work, entries[0]);
+      addTarget(work, entries[1]);
+
+      while (!work.empty())
+      {
+        unsigned address = work.back();
+        work.pop_back();
+        if (!decodable(address))
+          continue;
+        if (kind[address] == NONE)
+          kind[address] = INSTRUCTION;
+        if (seen(address))
+          continue;
+
+        unsigned char op = image[address];
+        unsigned next = address + length(op);
+        int lo = constantByte(address, 1), hi = constantByte(address, 2);
+        if (isBranch(op))
+        {
+          if (lo >= 0)
+            addTarget(work, (next + (lo < 0x80 ? lo : lo - 0x100)) & 0xffff);
+          addTarget(work, next);
+        }
+        else if (op == 0x20 || op == 0x4c)
+        {
+          if (lo >= 0 && hi >= 0)
+            addTarget(work, lo | (hi << 8));
+          if (op == 0x20)
+            addTarget(work, next);
+        }
+        else if (!endsBlock(op) && next < 0x10000)
+          work.push_back(next);
+      }
+      // the Kernal exit test must see these as soon as they are reached
+      if (kind[0xea31] != NONE) kind[0xea31] = LEADER;
+      if (kind[0xea81] != NONE) kind[0xea81] = LEADER;
+    }
+
+    bool seen(unsigned address)
+    {
+      if (visited.empty())
+        visited.assign(0x10000, 0);
+      if (visited[address])
+        return true;
+      visited[address] = 1;
+      return false;
+    }
+
+    void addTarget(std::vector<unsigned> &work, unsigned address)
+    {
+      kind[address] = LEADER;
+      work.push_back(address);
+    }
+
+    // a block starts at every leader and at every instruction not reached
+    // by falling through from a translated one
+    void findBlocks()
+    {
+      std::vector<unsigned char> fallthrough(0x10000);
+      for (unsigned a = 0; a < 0x10000; a++)
+        if (kind[a] != NONE && decodable(a) && !endsBlock(image[a]) && a + length(image[a]) < 0x10000)
+          fallthrough[a + length(image[a])] = 1;
+
+      blocks.clear();
+      instructions = 0;
+      fixed.assign(0x10000, 0);
+      for (unsigned a = 0; a < 0x10000; a++)
+      {
+        if (kind[a] == NONE || !decodable(a) || (kind[a] != LEADER && fallthrough[a]))
+          continue;
+        blocks.push_back(a);
+        for (unsigned p = a;;)
+        {
+          unsigned char op = image[p];
+          for (int i = 0; i < length(op); i++)
+            if (fixedByte(p, i) >= 0) fixed[p + i] = 1;
+          instructions++;
+          p += length(op);
+          if (endsBlock(op) || p >= 0x10000 || kind[p] != INSTRUCTION || !decodable(p))
+            break;
+        }
+      }
+    }
+
+    // per page bitmaps of the code bytes the blocks check
+    void writeFixedBytes(FILE *out)
+    {
+      bool used[256] = {false};
+      for (unsigned page = 0; page < 256; page++)
+      {
+        for (unsigned i = 0; i < 256; i++)
+          used[page] |= fixed[(page << 8) + i] != 0;
+        if (!used[page])
+          continue;
+        fprintf(out, "static const unsigned char page_%02x[32] = {", page);
+        for (unsigned i = 0; i < 32; i++)
+        {
+          unsigned bits = 0;
+          for (unsigned b = 0; b < 8; b++)
+            bits |= fixed[(page << 8) + i * 8 + b] << b;
+          fprintf(out, "%s0x%02x", i ? ", " : "", bits);
+        }
+        fprintf(out, "};\n");
+      }
+      fprintf(out, "\nstatic const unsigned char *const fixed[256] = {\n");
+      for (unsigned page = 0; page < 256; page++)
+      {
+        if (used[page])
+          fprintf(out, "%spage_%02x", page % 8 ? ", " : "  ", page);
+        else
+          fprintf(out, "%sNULL", page % 8 ? ", " : "  ");
+        fprintf(out, page % 8 == 7 ? (page == 255 ? "\n" : ",\n") : "");
+      }
+      fprintf(out, "};\n\n");
+    }
+
+    void writeBlock(FILE *out, unsigned start)
+    {
+      std::vector<unsigned> code;
+      for (unsigned p = start;;)
+      {
+        unsigned char op = image[p];
+        code.push_back(p);
+        p += length(op);
+        if (endsBlock(op) || p >= 0x10000 || kind[p] != INSTRUCTION || !decodable(p))
+          break;
+      }
+      unsigned end = code.back() + length(image[code.back()]);
+
+      fprintf(out, "// $%04x-$%04x\nstatic int block_%04x(CpuState &state, int &running)\n{\n", start, end - 1, start);
+      // the code bytes it was translated from must still be there
+      for (unsigned a = start; a < end;)
+      {
+        if (!fixed[a])
+        {
+          a++;
+          continue;
+        }
+        unsigned run = a;
+        while (run < end && fixed[run]) run++;
+        // short runs, as between the operands of a relocatable block, are
+        // cheaper compared byte by byte
+        if (run - a < 4)
+        {
+          for (; a < run; a++)
+            fprintf(out, "  if (state.mem[0x%04x] != 0x%02x) return 0;\n", a, image[a]);
+          continue;
+        }
+        fprintf(out, "  if (memcmp(&state.mem[0x%04x], \"", a);
+        for (unsigned i = a; i < run; i++)
+          fprintf(out, "\\x%02x", image[i]);
+        fprintf(out, "\", %u)) return 0;\n", run - a);
+        a = run;
+      }
+
+      for (size_t i = 0; i < code.size(); i++)
+      {
+        unsigned p = code[i];
+        int len = length(image[p]);
+        fprintf(out, "  {\n    // $%04x:", p);
+        for (int b = 0; b < len; b++)
+          fprintf(out, fixedByte(p, b) >= 0 ? " %02x" : " ??", image[p + b]);
+        char lo[8], hi[8];
+        operandArgument(lo, len > 1 ? fixedByte(p, 1) : 0);
+        operandArgument(hi, len > 2 ? fixedByte(p, 2) : 0);
+        fprintf(out, "\n    FixedAccess<0x%04x, 0x%02x, %s, %s> access = {state.mem, fixed, false};\n", p,
+          image[p], lo, hi);
+        fprintf(out, "    running = execute(state, access);\n");
+        fprintf(out, "    if (!running || access.modified) return %u;\n  }\n", (unsigned)i + 1);
+      }
+      fprintf(out, "  return %u;\n}\n\n", (unsigned)code.size());
+    }
+
+    static void operandArgument(char *dest, int value)
+    {
+      if (value < 0)
+        strcpy(dest, "-1");
+      else
+        sprintf(dest, "0x%02x", value);
+    }
+
+    bool relocatable;
+    std::vector<unsigned char> executed;
+    std::vector<unsigned char> written;
+    std::vector<unsigned char> image;
+    std::vector<unsigned char> kind;
+    std::vector<unsigned char> visited;
+    std::vector<unsigned char> fixed;
+    std::vector<unsigned> blocks;
+    unsigned entries[2] = {0, 0};
+    unsigned int instructions = 0;
+};
@@ -1,5 +1,34 @@
-extern unsigned char mem[];
-extern unsigned int cpucycles;
-extern unsigned short pc;
+#pragma once
+// Complete state of one emulated 6502 and its 64K of memory. initcpu() and
+// runcpu() work on the instance cpu points to; the pointer is per thread,
+// so every thread can drive its own machine.
+struct CpuState
+{
+  unsigned short pc;
+  unsigned char a;
+  unsigned char x;
+  unsigned char y;
+  unsigned char flags;
+  unsigned char sp;
+  unsigned char halted;  // set on a JAM or unknown opcode
+  unsigned int cpucycles;
+  unsigned char mem[0x10000];
+};
+
+// Sees every memory access of runcpuobserved(): opcode and operand
+// fetches, data reads and writes
+class CpuObserver
+{
+  public:
+    virtual ~CpuObserver() {}
+    virtual void opcode(unsigned address) = 0;
+    virtual void operand(unsigned address) = 0;
+    virtual void read(unsigned address) = 0;
+    virtual void write(unsigned address) = 0;
+};
+
+extern thread_local CpuState *cpu;
 void initcpu(unsigned short newpc, unsigned char newa, unsigned char newx, unsigned char newy);
 int runcpu(void);
+int runcpuobserved(CpuObserver *observer);
+int opcodelength(unsigned char op);
@@ -4,41 +4,149 @@
 #include <math.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <time.h>
 #include "cpu.h"
+#include "SidDriver.h"
 #include "SidOutput.h"
 #include "SidState.h"
-
-#define MAX_INSTR 0x100000
+#include "SidPipeline.h"
+#include "SidServer.h"
+#include "SnapshotCache.h"
+#include "SidScheduler.h"
+#include "Translator.h"
+#include "EngineDatabase.h"
+#include "MemoryHeatmap.h"
+#include "Timeline.h"
+#include "Metrics.h"
+#include "DumpCompare.h"
+#include "Fingerprint.h"
+#include "FeatureIndex.h"
+#include "TempoAnalysis.h"
 
 int main(int argc, char **argv);
-unsigned char readbyte(FILE *f);
-unsigned short readword(FILE *f);
-
-extern unsigned short pc;
 
 SidOutput *output;
 SidState sid;
 SidOutputOptions options;
 SidOutputFactory factory;
+SidTune tune;
+SidDriver driver;
+char timelinefile[256];
+char metricsfile[256];
+char tracefile[256];
+
+// write the timeline of the run when it ends, however it ends
+void saveTimeline(void)
+{
+  Timeline *timeline = Timeline::active();
+  timeline->print();
+  if (!timeline->save(timelinefile))
+    printf("Error: couldn't write %s\n", timelinefile);
+}
+
+// the instructions leading up to an error, or the end of the run
+void saveTrace(void)
+{
+  if (!driver.trace)
+    return;
+  if (driver.trace->save(tracefile))
+    printf("Trace of the last instructions written to %s\n", tracefile);
+  else
+    printf("Error: couldn't write %s\n", tracefile);
+}
+
+void saveMetrics(void)
+{
+  if (!Metrics::global().save(metricsfile))
+    printf("Error: couldn't write %s\n", metricsfile);
+}
+
+// play count tunes at once in real time, cycling through the SID files
+// given, and report how late their frames were picked up
+int playScheduled(const std::vector<char *> &sidnames, unsigned count, int subtune, SnapshotCache *snapshots)
+{
+  // init each file once, every tune playing it starts from a copy
+  std::vector<SidTune> files(sidnames.size());
+  std::vector<SidDriver::Snapshot> inits(sidnames.size());
+  for (size_t i = 0; i < sidnames.size(); i++)
+  {
+    const char *error = files[i].load(sidnames[i]);
+    if (error)
+    {
+      printf("Error: %s: %s\n", sidnames[i], error);
+      return 1;
+    }
+    SidDriver init;
+    TimelineSpan span(Timeline::INIT);
+    uint64_t initstart = Metrics::now();
+    if (!snapshots || !snapshots->load(files[i], subtune, init))
+    {
+      if (!init.init(files[i], subtune))
+      {
+        Metrics::global().add(Metrics::HALTS, 1);
+        return 1;
+      }
+      if (snapshots)
+        snapshots->save(files[i], subtune, init);
+    }
+    init.save(inits[i]);
+    Metrics::global().add(Metrics::INIT_TIME, Metrics::now() - initstart);
+  }
+
+  SidScheduler scheduler(options.threads ? options.threads : ThreadPool::defaultSize());
+  std::vector<ScheduledTune *> tunes;
+  for (unsigned i = 0; i < count; i++)
+  {
+    ScheduledTune *scheduled = new ScheduledTune(sidnames[i % sidnames.size()]);
+    scheduled->driver.restore(inits[i % sidnames.size()]);
+    scheduled->sid.reset();
+    scheduled->sid.time.end_time = options.seconds * 1000000;
+    scheduler.add(scheduled);
+    tunes.push_back(scheduled);
+  }
+  printf("Playing %u tunes for %d seconds\n", count, options.seconds);
+  fflush(stdout);
+
+  scheduler.run();
+  scheduler.print();
+  for (size_t i = 0; i < tunes.size(); i++)
+    delete tunes[i];
+  return 0;
+}
 
 int main(int argc, char **argv)
 {
   int subtune = 0;
-  int instr = 0;
   int firstframe = 0;
   int usage = 0;
   int mode = 0;
 
-  unsigned loadend;
-  unsigned loadpos;
-  unsigned loadsize;
-  unsigned loadaddress;
-  unsigned initaddress;
-  unsigned playaddress;
-  unsigned dataoffset;
-
-  FILE *in;
   char *sidname = 0;
+  std::vector<char *> sidnames;
+  char serverpath[256] = {0};
+  char snapshotdir[256] = {0};
+  unsigned memoentries = 0;
+  int memoverify = 0;
+  unsigned schedule = 0;
+  char translatefile[256] = {0};
+  int translateengine = 0;
+  int translateverify = 0;
+  int interpret = 0;
+  int showengine = 0;
+  char enginefile[256] = {0};
+  char heatmapfile[256] = {0};
+  unsigned metricsinterval = 10;
+  unsigned tracekb = 1024;
+  int tracealways = 0;
+  char tracedecode[256] = {0};
+  int compare = 0;
+  int checksums = 0;
+  char fingerprintfile[256] = {0};
+  char duplicatesfile[256] = {0};
+  unsigned similarity = 50;
+  char indexfile[256] = {0};
+  char queryfile[256] = {0};
+  int tempo = 0;
   int c;
 
   // Scan arguments
@@ -52,10 +160,78 @@ int main(int argc, char **argv)
         usage = 1;
         break;
 
+        case '-':
+        if (!strncmp(&argv[c][2], "server=", 7))
+          strncpy(serverpath, &argv[c][9], sizeof(serverpath) - 1);
+        if (!strncmp(&argv[c][2], "snapshots=", 10))
+          strncpy(snapshotdir, &argv[c][12], sizeof(snapshotdir) - 1);
+        if (!strncmp(&argv[c][2], "memo", 4))
+        {
+          memoentries = 256;
+          sscanf(&argv[c][6], "=%u", &memoentries);
+          if (!strcmp(&argv[c][6], "-verify")) memoverify = 1;
+        }
+        if (!strncmp(&argv[c][2], "schedule=", 9))
+          sscanf(&argv[c][11], "%u", &schedule);
+        if (!strncmp(&argv[c][2], "translate=", 10))
+          strncpy(translatefile, &argv[c][12], sizeof(translatefile) - 1);
+        if (!strncmp(&argv[c][2], "translate-engine=", 17))
+        {
+          strncpy(translatefile, &argv[c][19], sizeof(translatefile) - 1);
+          translateengine = 1;
+        }
+        if (!strcmp(&argv[c][2], "translate-verify"))
+          translateverify = 1;
+        if (!strcmp(&argv[c][2], "interpret"))
+          interpret = 1;
+        if (!strncmp(&argv[c][2], "timeline=", 9))
+          strncpy(timelinefile, &argv[c][11], sizeof(timelinefile) - 1);
+        if (!strncmp(&argv[c][2], "metrics=", 8))
+          strncpy(metricsfile, &argv[c][10], sizeof(metricsfile) - 1);
+        if (!strncmp(&argv[c][2], "metrics-interval=", 17))
+          sscanf(&argv[c][19], "%u", &metricsinterval);
+        if (!strncmp(&argv[c][2], "trace=", 6))
+          strncpy(tracefile, &argv[c][8], sizeof(tracefile) - 1);
+        if (!strncmp(&argv[c][2], "trace-size=", 11))
+          sscanf(&argv[c][13], "%u", &tracekb);
+        if (!strcmp(&argv[c][2], "trace-always"))
+          tracealways = 1;
+        if (!strncmp(&argv[c][2], "trace-decode=", 13))
+          strncpy(tracedecode, &argv[c][15], sizeof(tracedecode) - 1);
+        if (!strcmp(&argv[c][2], "compare"))
+          compare = 1;
+        if (!strcmp(&argv[c][2], "checksums"))
+          checksums = 1;
+        if (!strncmp(&argv[c][2], "fingerprint=", 12))
+          strncpy(fingerprintfile, &argv[c][14], sizeof(fingerprintfile) - 1);
+        if (!strncmp(&argv[c][2], "duplicates=", 11))
+          strncpy(duplicatesfile, &argv[c][13], sizeof(duplicatesfile) - 1);
+        if (!strncmp(&argv[c][2], "similarity=", 11))
+          sscanf(&argv[c][13], "%u", &similarity);
+        if (!strncmp(&argv[c][2], "index=", 6))
+          strncpy(indexfile, &argv[c][8], sizeof(indexfile) - 1);
+        if (!strncmp(&argv[c][2], "query=", 6))
+          strncpy(queryfile, &argv[c][8], sizeof(queryfile) - 1);
+        if (!strcmp(&argv[c][2], "tempo"))
+          tempo = 1;
+        if (!strncmp(&argv[c][2], "heatmap=", 8))
+          strncpy(heatmapfile, &argv[c][10], sizeof(heatmapfile) - 1);
+        if (!strncmp(&argv[c][2], "engines", 7))
+        {
+          showengine = 1;
+          if (argv[c][9] == '=')
+            strncpy(enginefile, &argv[c][10], sizeof(enginefile) - 1);
+        }
+        break;
+
         case 'A':
         sscanf(&argv[c][2], "%u", &subtune);
         break;
 
+        case 'B':
+        options.benchmark = 1;
+        break;
+
         case 'C':
         sscanf(&argv[c][2], "%x", &options.basefreq);
         break;
@@ -68,6 +244,16 @@ int main(int argc, char **argv)
         sscanf(&argv[c][2], "%u", &options.firstframe);
         break;
 
+        case 'J':
+        options.pipelined = 1;
+        sscanf(&argv[c][2], "%u", &options.ringsize);
+        if (options.ringsize < 2) options.ringsize = 2;
+        break;
+
+        case 'K':
+        sscanf(&argv[c][2], "%u", &options.keyframes);
+        break;
+
         case 'L':
         options.lowres = 1;
         break;
@@ -89,6 +275,15 @@ int main(int argc, char **argv)
         sscanf(&argv[c][2], "%u", &options.pattspacing);
         break;
 
+        case 'Q':
+        sscanf(&argv[c][2], "%u", &options.samplerate);
+        if (options.samplerate < 8000) options.samplerate = 8000;
+        break;
+
+        case 'R':
+        options.preallocate = 1;
+        break;
+
         case 'S':
         options.timeseconds = 1;
         break;
@@ -97,6 +292,19 @@ int main(int argc, char **argv)
         sscanf(&argv[c][2], "%u", &options.seconds);
         break;
         
+        case 'U':
+        strncpy(options.streamtarget, &argv[c][2], sizeof(options.streamtarget) - 1);
+        break;
+
+        case 'W':
+        sscanf(&argv[c][2], "%u", &options.threads);
+        break;
+
+        case 'Y':
+        sscanf(&argv[c][2], "%u", &options.runahead);
+        if (options.runahead < 2) options.runahead = 2;
+        break;
+
         case 'Z':
         options.profiling = 1;
         break;
@@ -105,6 +313,7 @@ int main(int argc, char **argv)
     else 
     {
       if (!sidname) sidname = argv[c];
+      sidnames.push_back(argv[c]);
     }
   }
 
@@ -115,9 +324,13 @@ int main(int argc, char **argv)
            "Warning: CPU emulation may be buggy/inaccurate, illegals support very limited\n\n"
            "Options:\n"
            "-a<value> Accumulator value on init (subtune number) default = 0\n"
+           "-b        Benchmark, report frames/s and bytes/s of the output when done\n"
            "-c<value> Frequency recalibration. Give note frequency in hex\n"
            "-d<value> Select calibration note (abs.notation 80-DF). Default middle-C (B0)\n"
            "-f<value> First frame to display, default 0\n"
+           "-j<value> Pipelined output, format and write frames on a separate thread\n"
+           "          value = frames buffered between the threads, default 1024\n"
+           "-k<value> Keyframe interval in frames for output mode 9, default 250\n"
            "-l        Low-resolution mode (only display 1 row per note)\n"
            "-m        Output mode, default 0\n"
            "          0 = output to screen, with note information\n"
@@ -127,20 +340,143 @@ int main(int argc, char **argv)
            "          4 = output to binary file, all sid registers + timing HI/LO bytes per frame\n"
            "          5 = output to screen, only output changed sid registers inc. timing HI/LO bytes\n"
            "          6 = output to binary file, only output changed sid registers inc. timing HI/LO bytes\n"
+           "          7 = output to binary file, 32 bit change mask + changed sid registers inc. timing HI/LO bytes\n"
+           "          8 = output to compressed file, all sid registers + timing HI/LO bytes per frame\n"
+           "          9 = output to binary file, as 6 with keyframes and a frame index for seeking\n"
+           "          10 = output to binary file, as 7 with repeated frame sequences as back references\n"
+           "          11 = output to columnar file, one stream per sid register + timing + cpu cycles\n"
+           "          12 = render to WAV file with the built-in SID model\n"
+           "          13 = live stream of changed sid registers, paced in real time\n"
            "-n<value> Note spacing, default 0 (none)\n"
            "-o<value> ""Oldnote-sticky"" factor. Default 1, increase for better vibrato display\n"
            "          (when increased, requires well calibrated frequencies)\n"
            "-p<value> Pattern spacing, default 0 (none)\n"
+           "-q<value> Sample rate in Hz for output mode 12, default 44100\n"
+           "-r        Preallocate the output file from the expected frame count\n"
            "-s        Display time in minutes:seconds:frame format\n"
            "-t<value> Playback time in seconds, default 60\n"
-           "-z        Include CPU cycles+rastertime (PAL)+rastertime, badline corrected\n");
+           "-u<value> Target for output mode 13: - (stdout, default), fifo:<path>, unix:<path>\n"
+           "          or shm:<name> (shared memory ring)\n"
+           "-w<value> Worker threads for compression, default one per CPU\n"
+           "-y<value> Frames the emulation may run ahead of a live stream, default 50\n"
+           "-z        Include CPU cycles+rastertime (PAL)+rastertime, badline corrected\n"
+           "--server=<path> Serve dump requests on a Unix domain socket instead, -w sets the workers\n"
+           "--snapshots=<dir> Cache the machine state after init in dir, later runs skip init\n"
+           "--memo[=<value>] Memoize playroutine calls by the memory they read, value = calls kept (256)\n"
+           "--memo-verify    As --memo, but interpret every hit too and report mismatches\n"
+           "--schedule=<value> Play value tunes at once in real time on -w threads, cycling\n"
+           "          through the SID files given, and report frame latencies\n"
+           "--translate=<file> Trace the code run by init and play and translate it to a C++ file,\n"
+           "          which can be linked in to run this tune and subtune's code natively\n"
+           "--translate-engine=<file> As --translate, with absolute addresses read from memory, so it\n"
+           "          also fits other tunes with the same engine at the same address\n"
+           "--translate-verify Check a linked in translation against the interpreter block by block\n"
+           "--interpret      Don't use a linked in translation\n"
+           "--engines[=<file>] Show the fingerprint of the player engine, named from a signature file\n"
+           "          (lines of <fingerprint> <name>); linked in translations are also used\n"
+           "          for other tunes with the same engine\n"
+           "--heatmap=<file> Count reads, writes and executes per address in init and play, written\n"
+           "          as JSON if file ends in .json, else binary\n"
+           "--timeline=<file> Time init and each frame's play, update and output per thread, saved\n"
+           "          at exit as Chrome trace-event JSON for Perfetto\n"
+           "--metrics=<file> Save run counters at exit as Prometheus text, or JSON if file ends in\n"
+           "          .json; with --server and --schedule also every --metrics-interval=<s> (10)\n"
+           "--trace=<file> Keep the last instructions in memory and write them to file if init or\n"
+           "          play fails; --trace-always also at the end, --trace-size=<kb> (1024)\n"
+           "--trace-decode=<file> Print a trace file as a disassembly listing\n"
+           "--checksums Also write a rolling checksum per frame to <sidfile>.sum\n"
+           "--compare <file1> <file2> Compare two dumps of mode -m2, -m4 or -m6, or two checksum\n"
+           "          files, and report the first frame that differs; exit code 1 if any does\n"
+           "--fingerprint=<file> Add a sketch of the notes played to a fingerprint file, which\n"
+           "          several runs can share\n"
+           "--duplicates=<file> List the near-duplicate tunes in a fingerprint file, those with\n"
+           "          at least --similarity=<percent> (50) of their note sequences in common\n"
+           "--index=<file> Add the features of the tune (waveforms, filter, ADSR, octaves, timing)\n"
+           "          to an index file, which several runs can share\n"
+           "--query=<file> <query> List the tunes in an index that match a query like\n"
+           "          \"ring3 & bandpass & !cia\", see README.md for the features\n"
+           "--tempo   Estimate the row speed and pattern length; in the note listing without\n"
+           "          -n, print it at the end with -n and -p (if not given) set from them\n");
     return 1;
   }
+
+  if (compare)
+  {
+    if (sidnames.size() != 2)
+    {
+      printf("Error: --compare needs two files\n");
+      return DumpCompare::FAILED;
+    }
+    DumpCompare dumps;
+    return dumps.run(sidnames[0], sidnames[1], mode);
+  }
+  if (duplicatesfile[0])
+  {
+    FingerprintIndex index;
+    if (!index.load(duplicatesfile))
+    {
+      printf("Error: %s is not a fingerprint file\n", duplicatesfile);
+      return 1;
+    }
+    index.printDuplicates(similarity / 100.0);
+    return 0;
+  }
+  if (queryfile[0])
+  {
+    std::string query;
+    for (size_t i = 0; i < sidnames.size(); i++)
+      query += std::string(i ? " " : "") + sidnames[i];
+    FeatureIndex index;
+    if (!index.load(queryfile))
+    {
+      printf("Error: %s is not an index file\n", queryfile);
+      return 1;
+    }
+    return index.query(query.c_str()) ? 0 : 1;
+  }
+  if (tracedecode[0])
+  {
+    if (decodeTrace(tracedecode, stdout))
+      return 0;
+    printf("Error: %s is not a trace file\n", tracedecode);
+    return 1;
+  }
+  if (timelinefile[0])
+  {
+    Timeline::active() = new Timeline;
+    atexit(saveTimeline);
+  }
+  if (metricsfile[0])
+  {
+    atexit(saveMetrics);
+    if ((serverpath[0] || schedule) && metricsinterval)
+      Metrics::global().saveEvery(metricsfile, metricsinterval);
+  }
+  SnapshotCache snapshots(snapshotdir);
+  if (serverpath[0])
+  {
+    SidServer server(options, options.threads ? options.threads : ThreadPool::defaultSize());
+    if (snapshotdir[0])
+      server.setSnapshotCache(&snapshots);
+    return server.run(serverpath);
+  }
+  if (schedule && sidnames.size())
+    return playScheduled(sidnames, schedule, subtune, snapshotdir[0] ? &snapshots : NULL);
   // use the factory to create the requested output object type
   output = factory.create(mode);
+  if (tempo)
+    output = new TempoOutput(output, mode == 0 && !options.spacing);
+  if (checksums)
+    output = new ChecksumOutput(output);
+  if (fingerprintfile[0] && sidname)
+    output = new FingerprintOutput(output, fingerprintfile, sidname, subtune);
+  if (indexfile[0] && sidname)
+    output = new FeatureOutput(output, indexfile, sidname, subtune);
 
   strcpy(options.songfilename, sidname);
   output->setOptions(&options);
+  if (options.pipelined)
+    output = new PipelinedOutput(output, options.ringsize);
 
   // Open SID file
   if (!sidname)
@@ -149,69 +485,72 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  in = fopen(sidname, "rb");
-  if (!in)
+  const char *error = tune.load(sidname);
+  if (error)
   {
-    printf("Error: couldn't open SID file.\n");
+    printf("Error: %s\n", error);
     return 1;
   }
 
-  // Read interesting parts of the SID header
-  fseek(in, 6, SEEK_SET);
-  dataoffset = readword(in);
-  loadaddress = readword(in);
-  initaddress = readword(in);
-  playaddress = readword(in);
-  fseek(in, dataoffset, SEEK_SET);
-  if (loadaddress == 0)
-    loadaddress = readbyte(in) | (readbyte(in) << 8);
-
-  // Load the C64 data
-  loadpos = ftell(in);
-  fseek(in, 0, SEEK_END);
-  loadend = ftell(in);
-  fseek(in, loadpos, SEEK_SET);
-  loadsize = loadend - loadpos;
-  if (loadsize + loadaddress >= 0x10000)
+  // Print info & run initroutine
+  printf("Load address: $%04X Init address: $%04X Play address: $%04X\n", tune.loadaddress, tune.initaddress, tune.playaddress);
+  printf("Calling initroutine with subtune %d\n", subtune);
+  Translator *translator = NULL;
+  MemoryHeatmap *heatmap = NULL;
+  if (translatefile[0] && heatmapfile[0])
   {
-    printf("Error: SID data continues past end of C64 memory.\n");
-    fclose(in);
+    printf("Error: --translate and --heatmap can't be used together\n");
     return 1;
   }
-  fread(&mem[loadaddress], loadsize, 1, in);
-  fclose(in);
-
-  // Print info & run initroutine
-  printf("Load address: $%04X Init address: $%04X Play address: $%04X\n", loadaddress, initaddress, playaddress);
-  printf("Calling initroutine with subtune %d\n", subtune);
-  mem[0x01] = 0x37;
-  initcpu(initaddress, subtune, 0, 0);
-  instr = 0;
-  while (runcpu())
+  if (translatefile[0])
+    driver.tracer = translator = new Translator(translateengine);
+  if (heatmapfile[0])
+    driver.tracer = heatmap = new MemoryHeatmap;
+  if (tracefile[0])
+    driver.trace = new InstructionTrace(tracekb);
+  Metrics::Run run;
   {
-    // Allow SID model detection (including $d011 wait) to eventually terminate
-    ++mem[0xd012];
-    if (!mem[0xd012] || ((mem[0xd011] & 0x80) && mem[0xd012] >= 0x38))
-    {
-        mem[0xd011] ^= 0x80;
-        mem[0xd012] = 0x00;
-    }
-    instr++;
-    if (instr > MAX_INSTR)
+    TimelineSpan span(Timeline::INIT);
+    uint64_t initstart = Metrics::now();
+    if (!driver.tracer && snapshotdir[0] && snapshots.load(tune, subtune, driver))
+      driver.printWarnings();
+    else
     {
-      printf("Warning: CPU executed a high number of instructions in init, breaking\n");
-      break;
+      if (!driver.init(tune, subtune))
+      {
+        run.values[Metrics::HALTS] = 1;
+        Metrics::global().finish(run);
+        saveTrace();
+        return 1;
+      }
+      if (snapshotdir[0])
+        snapshots.save(tune, subtune, driver);
     }
+    run.values[Metrics::INIT_TIME] = Metrics::now() - initstart;
   }
 
-  if (playaddress == 0)
+  if (translator)
+    translator->initDone(driver.state, tune.initaddress, driver.playaddress);
+  if (heatmap)
+    heatmap->setPhase(MemoryHeatmap::PLAY);
+  if (memoentries)
+    driver.memo = new PlayMemo(memoentries, memoverify);
+
+  uint64_t engine = engineFingerprint(driver.state.mem, driver.playaddress);
+  if (showengine)
   {
-    printf("Warning: SID has play address 0, reading from interrupt vector instead\n");
-    if ((mem[0x01] & 0x07) == 0x5)
-      playaddress = mem[0xfffe] | (mem[0xffff] << 8);
-    else
-      playaddress = mem[0x314] | (mem[0x315] << 8);
-    printf("New play address is $%04X\n", playaddress);
+    EngineDatabase engines;
+    if (enginefile[0] && !engines.load(enginefile))
+      printf("Warning: couldn't read %s\n", enginefile);
+    const char *name = engines.identify(engine);
+    printf("Engine: %016llx %s\n", (unsigned long long)engine, name ? name : "(unknown)");
+  }
+  const Translation *translation = Translation::find(tune.hash(subtune), engine);
+  if (translation && !interpret && !translator)
+  {
+    printf("Using translated code, %u blocks%s\n", translation->blocks,
+      translation->key == tune.hash(subtune) ? "" : " of another tune with this engine");
+    driver.translated = new TranslatedCode(translation, translateverify);
   }
 
   sid.reset();
@@ -219,6 +558,10 @@ int main(int argc, char **argv)
   printf("Calling playroutine for %d seconds, starting from frame %d\n", options.seconds, firstframe);
   // printf("Calling playroutine for %d frames, starting from frame %d\n", options.seconds*50, firstframe);
 
+  struct timespec benchstart;
+  clock_gettime(CLOCK_MONOTONIC, &benchstart);
+  uint64_t playstart = Metrics::now();
+
   output->preProcessing();
   
   // Data collection & display loop
@@ -226,28 +569,45 @@ int main(int argc, char **argv)
   while (sid.isPlaying)
   {
     // Run the playroutine
-    instr = 0;
-    initcpu(playaddress, 0, 0, 0);
-    while (runcpu())
+    PlayResult result;
     {
-      instr++;
-      if (instr > MAX_INSTR)
-      {
-        printf("Error: CPU executed abnormally high amount of instructions in playroutine, exiting\n");
-        return 1;
-      }
-      // Test for jump into Kernal interrupt handler exit
-      if ((mem[0x01] & 0x07) != 0x5 && (pc == 0xea31 || pc == 0xea81))
-        break;
+      TimelineSpan span(Timeline::PLAY, sid.time.current_frame);
+      result = driver.play();
+    }
+    run.values[Metrics::CYCLES] += driver.state.cpucycles;
+    if (result != PLAY_OK)
+    {
+      run.values[result == PLAY_HALTED ? Metrics::HALTS : Metrics::RUNAWAYS] = 1;
+      run.values[Metrics::INSTRUCTIONS] = driver.instructions;
+      Metrics::global().finish(run);
+      saveTrace();
+    }
+    // what was dumped up to here is still written out
+    if (result != PLAY_OK)
+      output->flush();
+    if (result == PLAY_HALTED)
+      return 1;
+    if (result == PLAY_RUNAWAY)
+    {
+      printf("Error: CPU executed abnormally high amount of instructions in playroutine, exiting\n");
+      return 1;
     }
 
     // Get SID parameters from each channel and the filter
-    sid.update(mem);
+    {
+      TimelineSpan span(Timeline::UPDATE, sid.time.current_frame);
+      sid.update(driver.state.mem);
+    }
+    sid.time.cycles = driver.state.cpucycles;
 
     // Frame display
     // if (frames >= firstframe)
     if (sid.time.current_frame >= firstframe)
+    {
+      TimelineSpan span(Timeline::SINK, sid.time.current_frame);
       output->processCurrentFrame(sid);
+      run.values[Metrics::FRAMES]++;
+    }
 
     // Advance to next frame
     sid.tick();
@@ -255,24 +615,52 @@ int main(int argc, char **argv)
   }
 
   output->postProcessing();
+  run.values[Metrics::PLAY_TIME] = Metrics::now() - playstart;
+  run.values[Metrics::INSTRUCTIONS] = driver.instructions;
+  run.addBytes(mode, output->bytesWritten());
+  Metrics::global().finish(run);
+  if (tracealways)
+    saveTrace();
+
+  if (driver.memo)
+    driver.memo->print();
+  if (driver.translated)
+    driver.translated->print();
+  if (heatmap)
+  {
+    heatmap->printSummary();
+    if (!heatmap->save(heatmapfile))
+    {
+      printf("Error: couldn't write %s\n", heatmapfile);
+      return 1;
+    }
+  }
+  if (translator)
+  {
+    if (!translator->save(translatefile, sidname, tune.hash(subtune), engine))
+    {
+      printf("Error: couldn't write %s\n", translatefile);
+      return 1;
+    }
+    printf("Translated %u instructions in %u blocks to %s\n", translator->instructionCount(),
+      translator->blockCount(), translatefile);
+  }
+
+  if (options.benchmark)
+  {
+    struct timespec benchend;
+    clock_gettime(CLOCK_MONOTONIC, &benchend);
+    double elapsed = (benchend.tv_sec - benchstart.tv_sec) + (benchend.tv_nsec - benchstart.tv_nsec) / 1e9;
+    unsigned frames = sid.time.current_frame - firstframe;
+    unsigned long long bytes = output->bytesWritten();
+    if (elapsed <= 0) elapsed = 1e-9;
+    printf("Benchmark: %u frames in %.3f s, %.0f frames/s", frames, elapsed, frames / elapsed);
+    if (bytes)
+      printf(", %llu bytes, %.0f bytes/s", bytes, bytes / elapsed);
+    printf("\n");
+  }
 
   // cleanup
   delete output;
   return 0;
 }
-
-unsigned char readbyte(FILE *f)
-{
-  unsigned char res;
-
-  fread(&res, 1, 1, f);
-  return res;
-}
-
-unsigned short readword(FILE *f)
-{
-  unsigned char res[2];
-
-  fread(&res, 2, 1, f);
-  return (res[0] << 8) | res[1];
-}